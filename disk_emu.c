@@ -1,109 +1,957 @@
+/*O_DIRECT is a GNU extension*/
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "disk_emu.h"
 
+/*io_uring is only there on Linux*/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+/*Alignment required by O_DIRECT on every device we care about*/
+#define DIRECT_IO_ALIGNMENT 4096
 
-FILE* fp = NULL;
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int MAX_RETRY;
+
+/*The device every block call goes through*/
+block_device disk = {NULL, 0, 0, NULL};
+
+/*The backend used by the next init, NULL until chosen*/
+const block_device_ops *backend = NULL;
+
+/*Counters of the transfers, updated atomically since calls may race*/
+static disk_stats stats;
+
+static void count_transfer(int writing, int nblocks)
+{
+    __atomic_fetch_add(writing ? &stats.writes : &stats.reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(writing ? &stats.bytes_written : &stats.bytes_read, (long long)nblocks * disk.block_size,
+                       __ATOMIC_RELAXED);
+}
+
+/*Pauses for the latency L of every block written by write_blocks*/
+static void charge_latency(int writing, int nblocks)
+{
+    if (writing && L > 0)
+        usleep((useconds_t)(L * nblocks));
+}
+
+/*Reads the monotonic clock, in microseconds*/
+static long long clock_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 /*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
+/*stdio backend: the original emulator. Every block written */
+/*pays an fseek and an fflush. The stream has one shared    */
+/*file position, so transfers are serialized.               */
 /*----------------------------------------------------------*/
-int close_disk()
+static pthread_mutex_t stdio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stdio_open(block_device *dev, char *filename, int fresh)
 {
-    if(NULL != fp)
+    FILE *fp;
+
+    if (!fresh)
+    {
+        /*Opens a file*/
+        fp = fopen (filename, "r+b");
+
+        if (fp == NULL)
+        {
+            printf("Could not open %s\n\n", filename);
+            return -1;
+        }
+        dev->private_data = fp;
+        return 0;
+    }
+
+    /*Creates a new file*/
+    fp = fopen (filename, "w+b");
+
+    if (fp == NULL)
     {
+        printf("Could not create new disk file %s\n\n", filename);
+        return -1;
+    }
+
+    /*Extends the empty file to its given size, which reads as 0's.*/
+    /*The file stays sparse until blocks are actually written.     */
+    if (ftruncate(fileno(fp), (off_t)dev->block_size * dev->num_blocks) == -1)
+    {
+        printf("Could not size disk file %s\n\n", filename);
         fclose(fp);
+        return -1;
     }
+    dev->private_data = fp;
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+static int stdio_read(block_device *dev, int start_address, int nblocks, void *buffer)
 {
-    int i, j;
+    int s;
+    FILE *fp = dev->private_data;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    /*Goto the data requested from the disk*/
+    pthread_mutex_lock(&stdio_lock);
+    fseek(fp, (long)start_address * dev->block_size, SEEK_SET);
 
-    if (fp == NULL)
+    /*Every block requested goes straight into the caller's buffer*/
+    s = (int) fread(buffer, dev->block_size, nblocks, fp);
+    pthread_mutex_unlock(&stdio_lock);
+
+    return s;
+}
+
+static int stdio_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    int i, s;
+    FILE *fp = dev->private_data;
+    s = 0;
+
+    /*Goto where the data is to be written on the disk*/
+    pthread_mutex_lock(&stdio_lock);
+    fseek(fp, (long)start_address * dev->block_size, SEEK_SET);
+
+    /*For every block requested*/
+    for (i = 0; i < nblocks; ++i)
     {
-        printf("Could not create new disk file %s\n\n", filename);
+        fwrite((char *)buffer+(i*dev->block_size), dev->block_size, 1, fp);
+        fflush(fp);
+        s++;
+    }
+    pthread_mutex_unlock(&stdio_lock);
+    return s;
+}
+
+static int stdio_sync(block_device *dev)
+{
+    FILE *fp = dev->private_data;
+    int result;
+
+    pthread_mutex_lock(&stdio_lock);
+    fflush(fp);
+    result = fsync(fileno(fp));
+    pthread_mutex_unlock(&stdio_lock);
+    return result;
+}
+
+static int stdio_close(block_device *dev)
+{
+    fclose(dev->private_data);
+    return 0;
+}
+
+static const block_device_ops stdio_ops = {
+    .name = "stdio",
+    .open = stdio_open,
+    .read = stdio_read,
+    .write = stdio_write,
+    .sync = stdio_sync,
+    .close = stdio_close,
+    /*No map, submit nor wait: every transfer runs synchronously*/
+};
+
+/*----------------------------------------------------------*/
+/*Helpers shared by the file descriptor based backends.     */
+/*----------------------------------------------------------*/
+
+/*Opens the disk file, sizing a fresh one in a single call*/
+static int open_disk_fd(block_device *dev, char *filename, int fresh, int extra_flags)
+{
+    struct stat st;
+    size_t size = (size_t)dev->block_size * dev->num_blocks;
+    int fd = open(filename, (fresh ? O_RDWR | O_CREAT : O_RDWR) | extra_flags, 0644);
+
+    if (fd == -1)
+    {
+        printf("Could not open %s: %s\n\n", filename, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Block devices come with their size; only regular files are sized here*/
+    if (S_ISREG(st.st_mode))
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        /*Truncating to zero first makes the whole image read as 0's*/
+        if (fresh && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1))
         {
-            fputc(0, fp);
+            printf("Could not size disk file %s\n\n", filename);
+            close(fd);
+            return -1;
+        }
+
+        if (!fresh && (size_t)st.st_size < size)
+        {
+            printf("Disk file %s is smaller than the disk\n\n", filename);
+            close(fd);
+            return -1;
         }
     }
+    return fd;
+}
+
+/*Transfers a whole range with pread/pwrite, retrying short transfers*/
+static int transfer_fd(int fd, int writing, char *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = writing ? pwrite(fd, buffer, size, offset) : pread(fd, buffer, size, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            printf("%s error at offset %ld\n", writing ? "pwrite" : "pread", (long)offset);
+            return -1;
+        }
+        buffer += n;
+        size -= n;
+        offset += n;
+    }
     return 0;
 }
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+
+/*----------------------------------------------------------*/
+/*io_uring: the file descriptor backends queue transfers on */
+/*a submission ring and reap them from a completion ring,   */
+/*so that many of them are in flight at once. The rings are */
+/*set up with the raw system calls. Where io_uring is not   */
+/*available, every request simply runs synchronously.       */
+/*----------------------------------------------------------*/
+#define URING_ENTRIES 64
+
+#ifdef HAVE_IO_URING
+
+typedef struct uring {
+    int fd;                     /*-1 if the ring could not be set up*/
+    int file;                   /*The disk file the ring transfers to*/
+    int block_size;
+    unsigned entries;
+    unsigned in_flight;         /*Submitted but not reaped yet*/
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int reaping;                /*Set while a thread waits in the kernel*/
+    pthread_mutex_t lock;
+    pthread_cond_t reaped;
+} uring;
+
+static int uring_init(uring *ring, int file, int block_size)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
 
-    if (fp == NULL)
+    ring->fd = -1;
+    ring->file = file;
+    ring->block_size = block_size;
+    ring->in_flight = 0;
+    ring->reaping = 0;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->reaped, NULL);
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
     {
-        printf("Could not open %s\n\n", filename);
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        ring->fd = -1;
         return -1;
     }
+
+    sq_ring = ring->sq_ring;
+    cq_ring = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
     return 0;
 }
 
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+static void uring_exit(uring *ring)
 {
-    int i, s;
-    s = 0;
+    if (ring->fd != -1)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+    }
+    pthread_cond_destroy(&ring->reaped);
+    pthread_mutex_destroy(&ring->lock);
+}
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+/*Completes every request the kernel is done with. Call it with the lock held*/
+static int uring_reap(uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    while (head != tail)
     {
-        printf("out of bound error %d\n", start_address);
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        block_request *request = (block_request *)(uintptr_t) cqe->user_data;
+        size_t size = (size_t)request->nblocks * ring->block_size;
+        size_t done = cqe->res < 0 ? 0 : (size_t)cqe->res;
+
+        /*A short or failed transfer is finished off synchronously*/
+        request->result = request->nblocks;
+        if (done < size && transfer_fd(ring->file, request->writing, (char *)request->buffer + done,
+                                       size - done, (off_t)request->start_address * ring->block_size + done) == -1)
+            request->result = -1;
+        request->done = 1;
+
+        head++;
+        ring->in_flight--;
+        reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/*Makes progress on the requests in flight. Call it with the lock held.*/
+/*Only one thread waits in the kernel; the others wait for it to reap. */
+static void uring_progress(uring *ring)
+{
+    if (ring->reaping)
+    {
+        pthread_cond_wait(&ring->reaped, &ring->lock);
+        return;
+    }
+
+    if (uring_reap(ring) == 0)
+    {
+        ring->reaping = 1;
+        pthread_mutex_unlock(&ring->lock);
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&ring->lock);
+        ring->reaping = 0;
+        uring_reap(ring);
+    }
+    pthread_cond_broadcast(&ring->reaped);
+}
+
+static int uring_submit(uring *ring, block_request *request)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+    long submitted;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->in_flight >= ring->entries)
+        uring_progress(ring);
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = ring->file;
+    sqe->addr = (uintptr_t) request->buffer;
+    sqe->len = (unsigned)((size_t)request->nblocks * ring->block_size);
+    sqe->off = (off_t)request->start_address * ring->block_size;
+    sqe->user_data = (uintptr_t) request;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do
+        submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    while (submitted == -1 && errno == EINTR);
+
+    if (submitted != 1)
+    {
+        /*The kernel did not take the entry, so take it back*/
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ring->lock);
         return -1;
     }
+    ring->in_flight++;
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+static int uring_wait(uring *ring, block_request *requests, int count)
+{
+    int i = 0;
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    pthread_mutex_lock(&ring->lock);
+    while (i < count)
     {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        if (requests[i].done)
+            i++;
+        else
+            uring_progress(ring);
     }
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
 
-    free(blockRead);
-    return s;
+#else
+
+typedef struct uring {
+    int fd;
+} uring;
+
+static int uring_init(uring *ring, int file, int block_size)
+{
+    ring->fd = -1;
+    return -1;
+}
+
+static void uring_exit(uring *ring)
+{
+}
+
+static int uring_submit(uring *ring, block_request *request)
+{
+    return -1;
+}
+
+static int uring_wait(uring *ring, block_request *requests, int count)
+{
+    return 0;
+}
+
+#endif
+
+/*State of the pread and direct backends*/
+typedef struct fd_state {
+    int fd;
+    void *bounce;                /*Aligned bounce buffer, direct backend only*/
+    size_t bounce_size;          /*Grows to the largest unaligned transfer*/
+    pthread_mutex_t bounce_lock; /*Serializes the users of the bounce buffer*/
+    uring ring;                  /*Queued transfers, if io_uring is available*/
+} fd_state;
+
+static fd_state *new_fd_state(block_device *dev, int fd)
+{
+    fd_state *state = (fd_state *) malloc(sizeof(fd_state));
+    state->fd = fd;
+    state->bounce = NULL;
+    state->bounce_size = 0;
+    pthread_mutex_init(&state->bounce_lock, NULL);
+    uring_init(&state->ring, fd, dev->block_size);
+    return state;
+}
+
+static int fd_close(block_device *dev)
+{
+    fd_state *state = dev->private_data;
+    close(state->fd);
+    free(state->bounce);
+    pthread_mutex_destroy(&state->bounce_lock);
+    uring_exit(&state->ring);
+    free(state);
+    return 0;
+}
+
+static int fd_sync(block_device *dev)
+{
+    /*O_DIRECT skips the page cache, not the device's write cache*/
+    return fdatasync(((fd_state *)dev->private_data)->fd);
+}
+
+static int fd_submit(block_device *dev, block_request *request)
+{
+    fd_state *state = dev->private_data;
+
+    if (state->ring.fd == -1)
+        return -1;
+    /*O_DIRECT transfers from unaligned buffers go through the bounce buffer*/
+    if (state->bounce != NULL && (uintptr_t)request->buffer % DIRECT_IO_ALIGNMENT != 0)
+        return -1;
+    return uring_submit(&state->ring, request);
+}
+
+static int fd_wait(block_device *dev, block_request *requests, int count)
+{
+    return uring_wait(&((fd_state *)dev->private_data)->ring, requests, count);
+}
+
+/*----------------------------------------------------------*/
+/*pread backend: positional I/O on a plain file descriptor. */
+/*There is no shared seek position and no stdio buffering.  */
+/*----------------------------------------------------------*/
+static int pread_open(block_device *dev, char *filename, int fresh)
+{
+    int fd = open_disk_fd(dev, filename, fresh, 0);
+    if (fd == -1)
+        return -1;
+    dev->private_data = new_fd_state(dev, fd);
+    return 0;
+}
+
+static int pread_read(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    fd_state *state = dev->private_data;
+    if (transfer_fd(state->fd, 0, buffer, (size_t)nblocks * dev->block_size,
+                    (off_t)start_address * dev->block_size) == -1)
+        return -1;
+    return nblocks;
+}
+
+static int pread_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    fd_state *state = dev->private_data;
+    if (transfer_fd(state->fd, 1, buffer, (size_t)nblocks * dev->block_size,
+                    (off_t)start_address * dev->block_size) == -1)
+        return -1;
+    return nblocks;
+}
+
+static const block_device_ops pread_ops = {
+    .name = "pread",
+    .open = pread_open,
+    .read = pread_read,
+    .write = pread_write,
+    .sync = fd_sync,
+    .close = fd_close,
+    .submit = fd_submit,
+    .wait = fd_wait,
+};
+
+/*----------------------------------------------------------*/
+/*direct backend: O_DIRECT on a file or a real block device.*/
+/*Buffers that are not suitably aligned go through an       */
+/*aligned bounce buffer, grown to hold the whole transfer.  */
+/*----------------------------------------------------------*/
+static int direct_open(block_device *dev, char *filename, int fresh)
+{
+    fd_state *state;
+    int fd;
+
+    if (dev->block_size % 512 != 0)
+    {
+        printf("O_DIRECT needs a block size that is a multiple of 512\n\n");
+        return -1;
+    }
+
+    fd = open_disk_fd(dev, filename, fresh, O_DIRECT);
+    if (fd == -1)
+        return -1;
+
+    state = new_fd_state(dev, fd);
+    dev->private_data = state;
+    if (posix_memalign(&state->bounce, DIRECT_IO_ALIGNMENT, dev->block_size) != 0)
+    {
+        state->bounce = NULL;
+        fd_close(dev);
+        return -1;
+    }
+    state->bounce_size = dev->block_size;
+    return 0;
+}
+
+static int direct_transfer(block_device *dev, int writing, int start_address, int nblocks, char *buffer)
+{
+    fd_state *state = dev->private_data;
+    size_t size = (size_t)nblocks * dev->block_size;
+    off_t offset = (off_t)start_address * dev->block_size;
+    void *bounce;
+
+    if ((uintptr_t)buffer % DIRECT_IO_ALIGNMENT == 0)
+    {
+        if (transfer_fd(state->fd, writing, buffer, size, offset) == -1)
+            return -1;
+        return nblocks;
+    }
+
+    pthread_mutex_lock(&state->bounce_lock);
+    if (state->bounce_size < size)
+    {
+        if (posix_memalign(&bounce, DIRECT_IO_ALIGNMENT, size) != 0)
+        {
+            pthread_mutex_unlock(&state->bounce_lock);
+            return -1;
+        }
+        free(state->bounce);
+        state->bounce = bounce;
+        state->bounce_size = size;
+    }
+
+    if (writing)
+        memcpy(state->bounce, buffer, size);
+    if (transfer_fd(state->fd, writing, state->bounce, size, offset) == -1)
+    {
+        pthread_mutex_unlock(&state->bounce_lock);
+        return -1;
+    }
+    if (!writing)
+        memcpy(buffer, state->bounce, size);
+    pthread_mutex_unlock(&state->bounce_lock);
+    return nblocks;
+}
+
+static int direct_read(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    return direct_transfer(dev, 0, start_address, nblocks, buffer);
+}
+
+static int direct_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    return direct_transfer(dev, 1, start_address, nblocks, buffer);
+}
+
+static const block_device_ops direct_ops = {
+    .name = "direct",
+    .open = direct_open,
+    .read = direct_read,
+    .write = direct_write,
+    .sync = fd_sync,
+    .close = fd_close,
+    .submit = fd_submit,
+    .wait = fd_wait,
+};
+
+/*----------------------------------------------------------*/
+/*mmap backend: the image is mapped with MAP_SHARED, so     */
+/*blocks are moved with memcpy and msync makes them durable.*/
+/*----------------------------------------------------------*/
+typedef struct mmap_state {
+    int fd;
+    char *map;
+    size_t size;
+} mmap_state;
+
+static int mmap_open(block_device *dev, char *filename, int fresh)
+{
+    mmap_state *state;
+    int fd = open_disk_fd(dev, filename, fresh, 0);
+    if (fd == -1)
+        return -1;
+
+    state = (mmap_state *) malloc(sizeof(mmap_state));
+    state->fd = fd;
+    state->size = (size_t)dev->block_size * dev->num_blocks;
+    state->map = mmap(NULL, state->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state->map == MAP_FAILED)
+    {
+        printf("Could not map disk file %s\n\n", filename);
+        close(fd);
+        free(state);
+        return -1;
+    }
+    dev->private_data = state;
+    return 0;
+}
+
+static int mmap_read(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    mmap_state *state = dev->private_data;
+    memcpy(buffer, state->map + (size_t)start_address * dev->block_size, (size_t)nblocks * dev->block_size);
+    return nblocks;
+}
+
+static int mmap_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    mmap_state *state = dev->private_data;
+    memcpy(state->map + (size_t)start_address * dev->block_size, buffer, (size_t)nblocks * dev->block_size);
+    return nblocks;
+}
+
+static int mmap_sync(block_device *dev)
+{
+    mmap_state *state = dev->private_data;
+    return msync(state->map, state->size, MS_SYNC);
+}
+
+static int mmap_close(block_device *dev)
+{
+    mmap_state *state = dev->private_data;
+    msync(state->map, state->size, MS_SYNC);
+    munmap(state->map, state->size);
+    close(state->fd);
+    free(state);
+    return 0;
+}
+
+static const void *mmap_map(block_device *dev, int start_address, int nblocks)
+{
+    mmap_state *state = dev->private_data;
+    return state->map + (size_t)start_address * dev->block_size;
+}
+
+static const block_device_ops mmap_ops = {
+    .name = "mmap",
+    .open = mmap_open,
+    .read = mmap_read,
+    .write = mmap_write,
+    .sync = mmap_sync,
+    .close = mmap_close,
+    .map = mmap_map,
+    /*No submit nor wait: every transfer runs synchronously*/
+};
+
+/*----------------------------------------------------------*/
+/*ram backend: the disk lives in memory, for tests. The     */
+/*image outlives close_disk, so that an init_disk in the    */
+/*same process finds what was written before.               */
+/*----------------------------------------------------------*/
+char *ram_image = NULL;
+size_t ram_image_size = 0;
+
+static int ram_open(block_device *dev, char *filename, int fresh)
+{
+    size_t size = (size_t)dev->block_size * dev->num_blocks;
+
+    if (!fresh)
+    {
+        if (ram_image == NULL || ram_image_size < size)
+        {
+            printf("Could not open %s: no RAM disk of that size\n\n", filename);
+            return -1;
+        }
+        return 0;
+    }
+
+    free(ram_image);
+    ram_image = (char *) calloc(size, 1);
+    ram_image_size = ram_image == NULL ? 0 : size;
+    return ram_image == NULL ? -1 : 0;
+}
+
+static int ram_read(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    memcpy(buffer, ram_image + (size_t)start_address * dev->block_size, (size_t)nblocks * dev->block_size);
+    return nblocks;
+}
+
+static int ram_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+    memcpy(ram_image + (size_t)start_address * dev->block_size, buffer, (size_t)nblocks * dev->block_size);
+    return nblocks;
+}
+
+static int ram_sync(block_device *dev)
+{
+    return 0;
+}
+
+static int ram_close(block_device *dev)
+{
+    return 0;
+}
+
+static const void *ram_map(block_device *dev, int start_address, int nblocks)
+{
+    return ram_image + (size_t)start_address * dev->block_size;
+}
+
+static const block_device_ops ram_ops = {
+    .name = "ram",
+    .open = ram_open,
+    .read = ram_read,
+    .write = ram_write,
+    .sync = ram_sync,
+    .close = ram_close,
+    .map = ram_map,
+    /*No submit nor wait: every transfer runs synchronously*/
+};
+
+/*----------------------------------------------------------*/
+/*Backend selection                                         */
+/*----------------------------------------------------------*/
+static const block_device_ops *builtin_backends[] = {
+    &stdio_ops, &pread_ops, &direct_ops, &mmap_ops, &ram_ops
+};
+
+/*----------------------------------------------------------*/
+/*Selects the backend used by the next init_fresh_disk or   */
+/*init_disk by name: "stdio" (the default), "pread",        */
+/*"direct", "mmap" or "ram". If never called, the           */
+/*SFS_DISK_BACKEND environment variable decides.            */
+/*----------------------------------------------------------*/
+int set_disk_backend(const char *name)
+{
+    int i;
+    for (i = 0; i < (int)(sizeof(builtin_backends) / sizeof(builtin_backends[0])); i++)
+    {
+        if (strcmp(builtin_backends[i]->name, name) == 0)
+        {
+            backend = builtin_backends[i];
+            return 0;
+        }
+    }
+    printf("Unknown disk backend %s\n\n", name);
+    return -1;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the latency L, in microseconds, paid for every block */
+/*written, whatever the backend. write_blocks pays it on    */
+/*the spot. The writes of a batch queued with submit_blocks */
+/*pay it in parallel, when wait_blocks waits for them.      */
+/*----------------------------------------------------------*/
+void set_disk_latency(double microseconds)
+{
+    L = microseconds;
+}
+
+/*----------------------------------------------------------*/
+/*Plugs in a backend that is not built in.                  */
+/*----------------------------------------------------------*/
+int set_disk_backend_ops(const block_device_ops *ops)
+{
+    if (ops == NULL || ops->open == NULL || ops->read == NULL || ops->write == NULL ||
+        ops->sync == NULL || ops->close == NULL)
+        return -1;
+    backend = ops;
+    return 0;
+}
+
+/*Resolves the backend for an init call*/
+static const block_device_ops *choose_backend()
+{
+    if (backend == NULL)
+    {
+        char *name = getenv("SFS_DISK_BACKEND");
+        if (name == NULL || set_disk_backend(name) == -1)
+            backend = &stdio_ops;
+    }
+    return backend;
+}
+
+/*Opens the current device with the chosen backend*/
+static int open_device(char *filename, int block_size, int num_blocks, int fresh)
+{
+    close_disk();
+
+    disk.ops = choose_backend();
+    disk.block_size = block_size;
+    disk.num_blocks = num_blocks;
+    disk.private_data = NULL;
+
+    if (disk.ops->open(&disk, filename, fresh) == -1)
+    {
+        disk.ops = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    if(NULL != disk.ops)
+    {
+        disk.ops->close(&disk);
+        disk.ops = NULL;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Forces everything written so far onto stable storage.      */
+/*----------------------------------------------------------*/
+int sync_disk()
+{
+    if (NULL == disk.ops)
+        return -1;
+    __atomic_fetch_add(&stats.syncs, 1, __ATOMIC_RELAXED);
+    return disk.ops->sync(&disk);
+}
+
+/*----------------------------------------------------------*/
+/*Hands out a pointer to the blocks themselves when the disk */
+/*lives in memory, so that callers can skip a copy. Returns  */
+/*NULL when the backend cannot do so. The blocks are only    */
+/*served for reading: a write through the pointer would      */
+/*change the disk behind the cache and the journal of the    */
+/*caller, so the pointer is const. Write with write_blocks.  */
+/*----------------------------------------------------------*/
+const void *map_blocks(int start_address, int nblocks)
+{
+    if (NULL == disk.ops || NULL == disk.ops->map)
+        return NULL;
+    if (start_address < 0 || start_address + nblocks > disk.num_blocks)
+        return NULL;
+    return disk.ops->map(&disk, start_address, nblocks);
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    return open_device(filename, block_size, num_blocks, 1);
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return open_device(filename, block_size, num_blocks, 0);
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (NULL == disk.ops || start_address < 0 || start_address + nblocks > disk.num_blocks)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    count_transfer(0, nblocks);
+    return disk.ops->read(&disk, start_address, nblocks, buffer);
 }
 
 /*------------------------------------------------------------------*/
@@ -111,33 +959,106 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, s;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (NULL == disk.ops || start_address < 0 || start_address + nblocks > disk.num_blocks)
     {
         printf("out of bound error\n");
         return -1;
     }
+    count_transfer(1, nblocks);
+    charge_latency(1, nblocks);
+    return disk.ops->write(&disk, start_address, nblocks, buffer);
+}
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+/*------------------------------------------------------------------*/
+/*Queues a number of transfers without waiting for them. Backends   */
+/*that cannot queue run each request on the spot. Every request is  */
+/*done, with its result set, after wait_blocks.                      */
+/*------------------------------------------------------------------*/
+int submit_blocks(block_request *requests, int count)
+{
+    int i, failed = 0;
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    for (i = 0; i < count; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        block_request *request = &requests[i];
+        request->done = 0;
+        request->deadline_us = 0;
+
+        /*Checks that the data requested is within the range of addresses of the disk*/
+        if (NULL == disk.ops || request->start_address < 0 ||
+            request->start_address + request->nblocks > disk.num_blocks)
+        {
+            printf("out of bound error %d\n", request->start_address);
+            request->result = -1;
+            request->done = 1;
+            failed = 1;
+            continue;
+        }
+        count_transfer(request->writing, request->nblocks);
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        /*A queued write pays L when it completes, in parallel with the rest of the batch*/
+        if (request->writing && L > 0)
+            request->deadline_us = clock_us() + (long long)(L * request->nblocks);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+        if (disk.ops->submit != NULL && disk.ops->submit(&disk, request) == 0)
+            continue;
+
+        request->result = request->writing
+            ? disk.ops->write(&disk, request->start_address, request->nblocks, request->buffer)
+            : disk.ops->read(&disk, request->start_address, request->nblocks, request->buffer);
+        request->done = 1;
     }
-    free(blockWrite);
-    return s;
+    return failed ? -1 : 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Waits for transfers queued with submit_blocks, and until the       */
+/*latency L of their writes has elapsed. Returns -1 if any of them   */
+/*failed.                                                            */
+/*------------------------------------------------------------------*/
+int wait_blocks(block_request *requests, int count)
+{
+    int i, failed = 0;
+    long long deadline_us = 0, now_us;
+
+    if (NULL != disk.ops && NULL != disk.ops->wait)
+        disk.ops->wait(&disk, requests, count);
+
+    for (i = 0; i < count; ++i)
+    {
+        if (requests[i].result == -1)
+            failed = 1;
+        if (requests[i].deadline_us > deadline_us)
+            deadline_us = requests[i].deadline_us;
+    }
+
+    /*Pause until the slowest write of the batch has paid its latency*/
+    if (deadline_us > 0 && (now_us = clock_us()) < deadline_us)
+        usleep((useconds_t)(deadline_us - now_us));
+    return failed ? -1 : 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the transfer counters out, each of them read atomically.    */
+/*------------------------------------------------------------------*/
+void get_disk_stats(disk_stats *out)
+{
+    out->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    out->bytes_read = __atomic_load_n(&stats.bytes_read, __ATOMIC_RELAXED);
+    out->bytes_written = __atomic_load_n(&stats.bytes_written, __ATOMIC_RELAXED);
+    out->syncs = __atomic_load_n(&stats.syncs, __ATOMIC_RELAXED);
+}
+
+/*------------------------------------------------------------------*/
+/*Zeroes the transfer counters.                                      */
+/*------------------------------------------------------------------*/
+void reset_disk_stats()
+{
+    __atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytes_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytes_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.syncs, 0, __ATOMIC_RELAXED);
 }
@@ -1,5 +1,67 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+struct block_device;
+
+/*A transfer queued with submit_blocks*/
+typedef struct block_request {
+    int writing;       /*1 to write the blocks, 0 to read them*/
+    int start_address;
+    int nblocks;
+    void *buffer;      /*Must stay valid until the request is done*/
+    int result;        /*The number of blocks transferred, or -1*/
+    int done;          /*Set once the request has completed*/
+    long long deadline_us; /*When a write has paid the latency L, set by submit_blocks*/
+} block_request;
+
+/*The operations a block device backend provides. Initialize it with designated*/
+/*initializers; the optional operations left out are NULL*/
+typedef struct block_device_ops {
+    const char *name;
+    /*Opens the disk; a fresh disk must read as 0's*/
+    int (*open)(struct block_device *dev, char *filename, int fresh);
+    /*Both return the number of blocks transferred, or -1*/
+    int (*read)(struct block_device *dev, int start_address, int nblocks, void *buffer);
+    int (*write)(struct block_device *dev, int start_address, int nblocks, void *buffer);
+    int (*sync)(struct block_device *dev);
+    int (*close)(struct block_device *dev);
+    /*Optional: a read-only pointer to the blocks, or NULL*/
+    const void *(*map)(struct block_device *dev, int start_address, int nblocks);
+    /*Optional: queues a request and returns at once, or -1 to have it run synchronously*/
+    int (*submit)(struct block_device *dev, block_request *request);
+    /*Optional: waits until every one of the requests is done*/
+    int (*wait)(struct block_device *dev, block_request *requests, int count);
+} block_device_ops;
+
+/*Counters of the transfers made to the disk*/
+typedef struct disk_stats {
+    long long reads;          /*Read calls, queued ones included*/
+    long long writes;         /*Write calls, queued ones included*/
+    long long bytes_read;
+    long long bytes_written;
+    long long syncs;
+} disk_stats;
+
+typedef struct block_device {
+    const block_device_ops *ops;
+    int block_size;
+    int num_blocks;
+    void *private_data; /*Owned by the backend*/
+} block_device;
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int sync_disk();
+int set_disk_backend(const char *name);
+int set_disk_backend_ops(const block_device_ops *ops);
+void set_disk_latency(double microseconds);
+const void *map_blocks(int start_address, int nblocks);
+int submit_blocks(block_request *requests, int count);
+int wait_blocks(block_request *requests, int count);
+void get_disk_stats(disk_stats *stats);
+void reset_disk_stats();
+
+#endif
@@ -9,10 +9,117 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/*
+ * An open file keeps its SFS file descriptor in fi->fh, from
+ * open() to release(), so each read and write is a single SFS
+ * call. The SFS gives a file one descriptor, so the opens of a
+ * file share an open_file, and the last release closes it. The
+ * calls using the descriptor hold its lock shared. Unlinking
+ * the file closes the descriptor, and holds the lock
+ * exclusively.
+ */
+struct open_file {
+    int fd;
+    int count;
+    char path[MAXFILENAME];
+    pthread_rwlock_t lock;
+    struct open_file *next;
+};
+
+static struct open_file *open_files;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct open_file *find_open_file(const char *path)
+{
+    struct open_file *file;
+    
+    for (file = open_files; file != NULL; file = file->next)
+        if (strcmp(file->path, path) == 0)
+            return file;
+    return NULL;
+}
+
+static void forget_open_file(struct open_file *file)
+{
+    struct open_file **link = &open_files;
+    
+    while (*link != file)
+        link = &(*link)->next;
+    *link = file->next;
+}
+
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+    struct open_file *file;
+    char filename[MAXFILENAME];
+    int fd;
+    
+    strcpy(filename, path);
+    
+    pthread_mutex_lock(&open_files_lock);
+    file = find_open_file(path);
+    if (file == NULL) {
+        fd = sfs_fopen(filename);
+        if (fd == -1) {
+            pthread_mutex_unlock(&open_files_lock);
+            return -errno;
+        }
+    
+        file = malloc(sizeof(struct open_file));
+        file->fd = fd;
+        file->count = 0;
+        strcpy(file->path, path);
+        pthread_rwlock_init(&file->lock, NULL);
+        file->next = open_files;
+        open_files = file;
+    }
+    file->count++;
+    fi->fh = (uint64_t)(uintptr_t)file;
+    pthread_mutex_unlock(&open_files_lock);
+    
+    return 0;
+}
+
+static struct open_file *get_handle(struct fuse_file_info *fi)
+{
+    return (struct open_file *)(uintptr_t)fi->fh;
+}
+
+/*
+ * A read-only file showing the stats of the SFS, see
+ * sfs_format_stats(). It has no open_file, so its fi->fh is 0.
+ */
+#define STATS_PATH "/.sfs_stats"
+#define STATS_TEXT_SIZE 8192
+
+static int is_stats_path(const char *path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+static int read_stats(char *buf, size_t size, off_t offset)
+{
+    char text[STATS_TEXT_SIZE];
+    int length = sfs_format_stats(text, sizeof(text));
+    
+    if (length >= (int)sizeof(text))
+        length = sizeof(text) - 1;
+    if (offset >= length)
+        return 0;
+    if (size > (size_t)(length - offset))
+        size = length - offset;
+    memcpy(buf, text + offset, size);
+    
+    return size;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -23,6 +130,10 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
+    } else if (is_stats_path(path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_format_stats(NULL, 0);
     } else if((size = sfs_getfilesize(path)) != -1) {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
@@ -37,27 +148,52 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
     char file_name[MAXFILENAME];
+    int dir;
     
     if (strcmp(path, "/") != 0)
         return -ENOENT;
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    filler(buf, STATS_PATH + 1, NULL, 0);
+    
+    dir = sfs_opendir();
+    if (dir == -1)
+        return -EMFILE;
     
-    while(sfs_getnextfilename(file_name)) {
+    while(sfs_readdir(dir, file_name) == 1) {
         filler(buf, &file_name[1], NULL, 0);
     }
     
+    sfs_closedir(dir);
+    
     return 0;
 }
 
 static int fuse_unlink(const char *path)
 {
+    struct open_file *file;
     int res;
     char filename[MAXFILENAME];
     
     strcpy(filename, path);
+    if (is_stats_path(path))
+        return -EACCES;
+    
+    /* The SFS closes the descriptor, and the handles still open are left without a file */
+    pthread_mutex_lock(&open_files_lock);
+    file = find_open_file(path);
+    if (file != NULL)
+        pthread_rwlock_wrlock(&file->lock);
     res = sfs_remove(filename);
+    if (file != NULL) {
+        if (res != -1) {
+            file->fd = -1;
+            forget_open_file(file);
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&open_files_lock);
     if (res == -1)
         return -errno;
     
@@ -66,85 +202,144 @@ static int fuse_unlink(const char *path)
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
-    char filename[MAXFILENAME];
+    if (is_stats_path(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        /* The text changes between reads, so its size is not to be trusted */
+        fi->direct_io = 1;
+        fi->fh = 0;
+        return 0;
+    }
     
-    strcpy(filename, path);
+    return open_handle(path, fi);
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_handle(fi);
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    if (file == NULL)
+        return 0;
+    
+    pthread_mutex_lock(&open_files_lock);
+    if (--file->count > 0) {
+        pthread_mutex_unlock(&open_files_lock);
+        return 0;
+    }
+    
+    if (file->fd != -1) {
+        sfs_fclose(file->fd);
+        forget_open_file(file);
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    pthread_rwlock_destroy(&file->lock);
+    free(file);
     
-    sfs_fclose(res);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
+    struct open_file *file = get_handle(fi);
     int res;
     
-    char filename[MAXFILENAME];
+    if (file == NULL)
+        return read_stats(buf, size, offset);
     
-    strcpy(filename, path);
+    /* The SFS takes int offsets, and no file goes past INT_MAX */
+    if (offset >= INT_MAX)
+        return 0;
+    if (offset > INT_MAX - (off_t)size)
+        size = INT_MAX - offset;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    pthread_rwlock_rdlock(&file->lock);
+    if (file->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pread(file->fd, buf, size, offset)) == -1)
+        res = -EIO;
+    pthread_rwlock_unlock(&file->lock);
     
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
+    struct open_file *file = get_handle(fi);
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (file == NULL)
+        return -EACCES;
+    if (offset > INT_MAX - (off_t)size)
+        return -EFBIG;
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    pthread_rwlock_rdlock(&file->lock);
+    if (file->fd == -1)
+        res = -EBADF;
+    else if ((res = sfs_pwrite(file->fd, buf, size, offset)) == -1)
+        res = -ENOSPC;
+    pthread_rwlock_unlock(&file->lock);
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
+    struct open_file *file;
     char filename[MAXFILENAME];
     int fd;
+    int res;
     
     strcpy(filename, path);
+    if (is_stats_path(path))
+        return -EACCES;
+    if (size > INT_MAX)
+        return -EFBIG;
     
-    fd = sfs_remove(filename);
+    /* An open file is truncated through its descriptor, any other file is opened for the call */
+    pthread_mutex_lock(&open_files_lock);
+    file = find_open_file(path);
+    if (file != NULL)
+        fd = file->fd;
+    else if (sfs_getfilesize(filename) == -1)
+        fd = -1;
+    else
+        fd = sfs_fopen(filename);
+    res = fd == -1 ? -1 : sfs_ftruncate(fd, size);
+    if (file == NULL && fd != -1)
+        sfs_fclose(fd);
+    pthread_mutex_unlock(&open_files_lock);
     if (fd == -1)
-        return -errno;
+        return -ENOENT;
+    if (res == -1)
+        return -ENOSPC;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_handle(fi);
+    int res;
+    
+    if (file == NULL)
+        return -EACCES;
+    if (size > INT_MAX)
+        return -EFBIG;
+    
+    pthread_rwlock_rdlock(&file->lock);
+    if (file->fd == -1)
+        res = -EBADF;
+    else if (sfs_ftruncate(file->fd, size) == -1)
+        res = -ENOSPC;
+    else
+        res = 0;
+    pthread_rwlock_unlock(&file->lock);
+    
+    return res;
+}
+
 static int fuse_access(const char *path, int mask)
 {
     return 0;
@@ -157,31 +352,59 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    if (is_stats_path(path))
+        return -EEXIST;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    return open_handle(path, fp);
+}
+
+/* Only fsync and unmounting make the data durable, a close does not */
+static int fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    struct open_file *file = get_handle(fi);
+    int res;
+    
+    if (file == NULL)
+        return 0;
+    
+    pthread_rwlock_rdlock(&file->lock);
+    res = file->fd == -1 ? 0 : sfs_fsync(file->fd);
+    pthread_rwlock_unlock(&file->lock);
+    if (res == -1)
+        return -EIO;
     
-    sfs_fclose(fd);
     return 0;
 }
 
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    sfs_options options;
+    
+    /* Write back, for group commit and delayed allocation */
+    sfs_default_options(&options);
+    options.durability = SFS_WRITE_BACK;
+    mksfs_with_options(1, &options);
     return fuse_main(argc, argv, &xmp_oper, NULL);
 }
@@ -1,6 +1,10 @@
 #include "sfs_api.h"
 
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,12 +14,34 @@
 
 #define MAX_FILE_NAME_LENGTH 25
 #define MAX_FILE_EXTENSION_LENGTH 5
-#define FILE_SYSTEM_SIZE 1024
-#define FILE_SYSTEM_BLOCK_SIZE 1024
-#define INDIRECT_BLOCK_SIZE (FILE_SYSTEM_BLOCK_SIZE / sizeof(int))
-#define NUM_OF_I_NODES 200
+#define MAX_FILE_NAME_SIZE (MAX_FILE_NAME_LENGTH + MAX_FILE_EXTENSION_LENGTH + 3)  // Including the '\0'.
+#define DEFAULT_FILE_SYSTEM_SIZE 1024
+#define DEFAULT_FILE_SYSTEM_BLOCK_SIZE 1024
+#define DEFAULT_NUM_OF_I_NODES 200
+#define MIN_FILE_SYSTEM_BLOCK_SIZE 512  // Also the size of the probe reading the super block at mount.
+#define MAX_FILE_SYSTEM_BLOCK_SIZE (1 << 20)
+#define MAGIC_NUMBER 260917301
+#define JOURNAL_MAGIC_NUMBER 260917302         // Starts a journal descriptor.
+#define JOURNAL_COMMIT_MAGIC_NUMBER 260917303  // Starts a journal commit record.
+#define DEFAULT_JOURNAL_LENGTH 32
+#define MIN_JOURNAL_LENGTH 3        // A descriptor, one block image and a commit record.
+#define JOURNAL_GROUP_COMMIT_OPS 16  // The most operations grouped into one transaction.
+#define INDIRECT_BLOCK_SIZE ((int)(FILE_SYSTEM_BLOCK_SIZE / sizeof(int)))
+#define I_NODE_SIZE 256       // The size of an i-Node record, in bytes.
+#define I_NODE_INLINE_DATA 1  // A flag of the i-Node: the data of the file is kept in the i-Node.
+#define I_NODE_INLINE_DATA_SIZE ((int)(sizeof(i_node) - offsetof(i_node, direct_pointers)))
 #define NUM_OF_FILES (NUM_OF_I_NODES - 1)
-#define VERBOSE true
+#define BITMAP_SIZE ((FILE_SYSTEM_SIZE + 7) / 8)  // The size of the g_bitmap, in bytes.
+#define MAX_DIR_ITERATORS 16
+#define CACHE_NUM_OF_SLOTS 64
+#define CACHE_HASH_SIZE 128  // Must be a power of two.
+#define CACHE_WRITE_AROUND_THRESHOLD (CACHE_NUM_OF_SLOTS / 4)
+#define MAX_QUEUED_RUNS 16  // The runs an sfs_fwrite hands to its commit.
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_MAX_WINDOW (CACHE_NUM_OF_SLOTS / 4)
+#define DELAYED_MAX_BLOCKS 256  // The most appended blocks an FD holds before choosing their blocks.
+#define BUFFER_POOL_SIZE 8      // The most I/O buffers kept for reuse.
+#define BUFFER_ALIGNMENT 4096   // Suits O_DIRECT, so pooled buffers skip the bounce buffer of the disk.
 
 #pragma region Some Output Colors
 // Regular text
@@ -101,28 +127,98 @@ typedef struct super_block {
   int i_node_table_length;  // The number of blocks to contain all i-nodes.
   int i_node_num;           // The number of i-nodes we have in this disk.
   int root_directory;       // The pointer to the i-node for the root directory.
+  int i_node_table_start;     // The first block of the i-node table.
+  int root_directory_length;  // The number of blocks to contain the root directory.
+  int data_block_start;       // The first data block.
+  int bitmap_start;           // The first block of the bitmap.
+  int bitmap_length;          // The number of blocks to contain the bitmap.
+  int journal_start;          // The first block of the metadata journal.
+  int journal_length;         // The number of blocks of the journal, 0 if there is none.
 } super_block;
 
 typedef struct i_node {
   int mode, link_count, uid, gid;
   int size;                 // The size of the file.
+  int flags;                // I_NODE_INLINE_DATA, or 0.
   int direct_pointers[12];  // 12 direct pointers, each pointing to a data
                             // block.
   int indirect_pointer;     // One indirect pointer, which points to a block
                             // containing references to subsequent blocks.
+  int double_indirect_pointer;  // Points to a block of indirect pointers.
+  int triple_indirect_pointer;  // Points to a block of double indirect pointers.
+  char padding[I_NODE_SIZE - 21 * sizeof(int)];  // Together with the pointers, holds the inline data.
 } i_node;
 
 typedef struct directory_entry {
   int i_node_id;  // The i-Node this directory points to.
-  char file_name[MAX_FILE_NAME_LENGTH + MAX_FILE_EXTENSION_LENGTH + 1];
+  char file_name[MAX_FILE_NAME_SIZE];
 } directory_entry;
 
 typedef struct fdt_entry {
   int i_node_idx;          // The idx of the i-Node this file points to.
   int read_write_pointer;  // The read/write pointer of this file.
+  int last_block_idx;      // The block of the file translated last, -1 if none.
+  int last_block_id;       // The block ID it translated to.
+  int map_first_idx;       // The first block of the file mapped by map, -1 if none.
+  int *map;                // A copy of the pointer block translated through last.
+  int last_read_end;       // Where the last read stopped, to tell sequential reads.
+  int readahead_window;    // The number of blocks to read ahead, 0 if reads are not sequential.
+  int readahead_end_idx;   // The first block of the file not read ahead yet.
+  int tail_block_idx;      // The block of the file held in tail, -1 if none.
+  int tail_block_id;       // The block ID of that block.
+  char *tail;              // A partially written block, kept out of the cache. Changed with the i-Node write locked.
+  char *delayed;           // Data appended past the last block of the file, with no blocks chosen yet.
+  int delayed_size;        // The number of bytes in delayed, 0 if none. Changed with the i-Node write locked.
+  int delayed_capacity;    // The size of the delayed buffer.
+  int delayed_reserved;    // The free blocks reserved for the delayed data.
+  pthread_mutex_t lock;    // Serializes the calls using this entry.
 } fdt_entry;
+
+typedef struct cache_slot {
+  int block_id;     // The block held by this slot, -1 if vacant.
+  bool dirty;       // Whether the slot differs from the disk.
+  bool referenced;  // The CLOCK reference bit.
+  int hash_next;    // The next slot in the same hash bucket.
+  char *data;       // The cached copy of the block.
+} cache_slot;
+
+typedef struct pooled_buffer {
+  char *data;   // The buffer, aligned to BUFFER_ALIGNMENT.
+  size_t size;  // The size of the buffer, in bytes.
+  bool in_use;  // Whether the buffer is handed out.
+} pooled_buffer;
+
+typedef struct metadata_region {
+  int start;                // The first block of the region on the disk.
+  int length;               // The number of blocks in the region.
+  const char *source;       // The in-memory table the region saves.
+  char *data;               // The copy of the table to be saved, updated as entries are marked dirty.
+  int data_size;            // The size of the table, in bytes.
+  bool *dirty_blocks;       // Which blocks of the region have been modified.
+  int num_of_dirty_blocks;  // The number of modified blocks.
+} metadata_region;
+
+typedef struct slot_map {
+  uint64_t *words;   // One bit per slot of a table, set if the slot is vacant.
+  int num_of_words;  // The number of words.
+  int first_word;    // No vacant slot sits in a word before this one.
+} slot_map;
+
+// Starts the descriptor and the commit record of a transaction.
+// In a descriptor, the block IDs of the images follow.
+typedef struct journal_header {
+  int magic_number;   // JOURNAL_MAGIC_NUMBER or JOURNAL_COMMIT_MAGIC_NUMBER.
+  unsigned sequence;  // The number of the transaction.
+  int num_of_blocks;  // The number of block images in the transaction.
+  unsigned checksum;  // In a commit record, the checksum of the descriptor and the images.
+} journal_header;
 #pragma endregion
 
+// The volume geometry, recorded in the super block.
+int FILE_SYSTEM_SIZE = DEFAULT_FILE_SYSTEM_SIZE;
+int FILE_SYSTEM_BLOCK_SIZE = DEFAULT_FILE_SYSTEM_BLOCK_SIZE;
+int NUM_OF_I_NODES = DEFAULT_NUM_OF_I_NODES;
+
 int I_NODE_TABLE_START = 1;
 int I_NODE_TABLE_LENGTH;
 int ROOT_DIRECTORY_START;
@@ -131,14 +227,74 @@ int DATA_BLOCK_START;
 int DATA_BLOCK_LENGTH;
 int BITMAP_START;
 int BITMAP_LENGTH;
-
-// Cached variables.
-i_node g_inode_table[NUM_OF_I_NODES];
-fdt_entry g_fdt[NUM_OF_FILES];
-directory_entry g_root_directory_table[NUM_OF_FILES];
-unsigned char g_bitmap[FILE_SYSTEM_SIZE / 8];
-
-int root_file_counter = 0;
+int JOURNAL_START;
+int JOURNAL_LENGTH = 0;
+
+// The durability of the calls, SFS_WRITE_THROUGH or SFS_WRITE_BACK.
+int g_durability = SFS_WRITE_THROUGH;
+
+// Cached variables, sized by the geometry at mount.
+i_node *g_inode_table = NULL;
+bool *g_inode_blocks_loaded = NULL;  // Which blocks of the i-Node table are paged in.
+fdt_entry *g_fdt = NULL;
+directory_entry *g_root_directory_table = NULL;
+unsigned char *g_bitmap = NULL;
+int g_bitmap_num_of_free_blocks = 0;
+int g_bitmap_next_fit = 0;
+int g_bitmap_num_of_reserved_blocks = 0;  // Free blocks promised to delayed data.
+
+int root_file_counter = 0;  // The slot cursor of sfs_getnextfilename.
+int g_defrag_cursor = 0;    // The slot cursor of sfs_defrag.
+
+// The slot cursors of the directory iterators, -1 if unused.
+int g_dir_iterators[MAX_DIR_ITERATORS];
+
+// In-memory lookup indices, rebuilt at mount.
+int *g_root_hash_heads = NULL;  // The first directory slot in each bucket.
+int g_root_hash_size = 0;       // The number of buckets, a power of two.
+int *g_root_hash_next = NULL;   // The next directory slot in the same bucket.
+int *g_inode_fd = NULL;         // The FD through which each i-Node is open, or -1.
+slot_map g_root_vacant_slots;   // The vacant directory slots.
+slot_map g_fdt_vacant_slots;    // The vacant FDT entries.
+slot_map g_inode_vacant_slots;  // The vacant i-Nodes among those paged in.
+int g_inode_load_cursor = 0;    // The blocks of the i-Node table before it are all paged in.
+
+// Locks, always taken in the order they are listed. An FDT entry
+// comes right after g_dir_lock, and an i-Node right after that.
+pthread_rwlock_t g_dir_lock = PTHREAD_RWLOCK_INITIALIZER;    // The root directory, its indices, and the FDT slots.
+pthread_rwlock_t *g_inode_locks = NULL;                      // The size and the blocks of each i-Node.
+pthread_mutex_t g_journal_lock = PTHREAD_MUTEX_INITIALIZER;  // The running transaction and the journal.
+pthread_mutex_t g_alloc_lock = PTHREAD_MUTEX_INITIALIZER;    // The g_bitmap, its cursor, reservations and deferred frees.
+pthread_mutex_t g_load_lock = PTHREAD_MUTEX_INITIALIZER;     // Paging in the i-Node table, and its vacant slots.
+pthread_mutex_t g_meta_lock = PTHREAD_MUTEX_INITIALIZER;     // The dirty tracking of the metadata tables.
+pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;    // The block cache.
+pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;     // The pool of I/O buffers.
+
+// Dirty tracking for the cached metadata tables.
+metadata_region g_i_node_region;
+metadata_region g_root_directory_region;
+metadata_region g_bitmap_region;
+
+// The running transaction of the journal.
+unsigned g_journal_sequence = 1;          // The number of the next transaction.
+int g_journal_num_of_ops = 0;             // The operations grouped into it so far.
+int *g_journal_freed_blocks = NULL;       // Blocks it frees, allocatable once it commits.
+int g_journal_num_of_freed_blocks = 0;
+int g_journal_freed_blocks_capacity = 0;
+
+// The block cache sitting in front of the disk emulator.
+cache_slot g_cache[CACHE_NUM_OF_SLOTS];
+int g_cache_hash[CACHE_HASH_SIZE];
+int g_cache_clock_hand = 0;
+int g_cache_num_of_dirty_slots = 0;
+
+// The temporary I/O buffers kept for reuse.
+pooled_buffer g_buffer_pool[BUFFER_POOL_SIZE];
+
+// Instrumentation. The counters are updated atomically, without locks.
+sfs_stats g_stats;              // The disk counters are kept by the disk emulator instead.
+bool g_verbose = false;         // Whether print_error() prints.
+bool g_verbose_is_set = false;  // Whether sfs_set_verbose() overrides SFS_VERBOSE.
 
 #pragma region General Utils
 /**
@@ -157,23 +313,6 @@ int calculate_block_length(int file_size) {
   return a + b;
 }
 
-/**
- * @brief
- * Write the specified data to a buffer.
- *
- * @param data The data to be written.
- * @param data_size The size of data, in bytes.
- * @return void* The pointer to the result buffer.
- */
-void *write_data_to_a_buffer(void *data, unsigned int data_size) {
-  unsigned int num_of_blocks_needed = calculate_block_length(data_size);
-  unsigned int total_mem_size = num_of_blocks_needed * FILE_SYSTEM_BLOCK_SIZE;
-  void *buffer = (void *)malloc(total_mem_size);
-  memset(buffer, 0, total_mem_size);
-  memcpy(buffer, data, data_size);
-  return buffer;
-}
-
 int min(int a, int b) { return a <= b ? a : b; }
 
 int max(int a, int b) { return a >= b ? a : b; }
@@ -184,493 +323,2986 @@ int max(int a, int b) { return a >= b ? a : b; }
  * @param msg The msg to print.
  */
 void print_error(char *msg) {
-  if (VERBOSE) {
-    printf(GRN "ING TIAN: " BRED "[SFS ERROR] " BBLU "TIMESTAMP: " reset "%lu --> " reset "%s\n", time(NULL), msg);
-  }
+  if (!g_verbose) return;
+  printf(GRN "ING TIAN: " BRED "[SFS ERROR] " BBLU "TIMESTAMP: " reset "%lu --> " reset "%s\n", time(NULL), msg);
 }
-#pragma endregion
 
-#pragma region Bitmap Utils
 /**
  * @brief
- * Check whether the specified block is
- * available according to the g_bitmap.
- * @param block_id The ID of the block to investigate.
- * @return True If free.
- * @return False If occupied.
+ * Size a slot map for a table, with
+ * every slot taken.
+ * @param map The slot map.
+ * @param num_of_slots The number of slots of the table.
  */
-bool bitmap_is_block_free(int block_id) {
-  int row_num = block_id / 8, column_num = block_id % 8;
-  return (g_bitmap[row_num] & (1 << column_num)) > 0;
+void slot_map_init(slot_map *map, int num_of_slots) {
+  free(map->words);
+  map->num_of_words = (num_of_slots + 63) / 64;
+  map->words = (uint64_t *)calloc(map->num_of_words, sizeof(uint64_t));
+  map->first_word = map->num_of_words;
 }
 
 /**
  * @brief
- * Free a block in the g_bitmap
- * by setting it to 1.
- * @param block_id The ID of the block to free.
+ * Mark a slot as vacant.
+ * @param map The slot map.
+ * @param slot_idx The slot.
  */
-void bitmap_free_a_block(int block_id) {
-  int row_num = block_id / 8, column_num = block_id % 8;
-  g_bitmap[row_num] |= (1 << column_num);
+void slot_map_release(slot_map *map, int slot_idx) {
+  map->words[slot_idx / 64] |= (uint64_t)1 << (slot_idx % 64);
+  map->first_word = min(map->first_word, slot_idx / 64);
 }
 
 /**
  * @brief
- * Occupy a block in the g_bitmap
- * by setting it to 0.
- * @param block_id The ID of the block to occupy.
+ * Mark a slot as taken.
+ * @param map The slot map.
+ * @param slot_idx The slot.
  */
-void bitmap_occupy_a_block(int block_id) {
-  int row_num = block_id / 8, column_num = block_id % 8;
-  g_bitmap[row_num] &= ~(1 << column_num);
+void slot_map_take(slot_map *map, int slot_idx) { map->words[slot_idx / 64] &= ~((uint64_t)1 << (slot_idx % 64)); }
+
+/**
+ * @brief
+ * Find the first vacant slot, leaving it vacant.
+ * Words found full are skipped by later calls,
+ * so a series of allocations is linear overall.
+ * @param map The slot map.
+ * @return The slot, if any is vacant.
+ * @return -1, otherwise.
+ */
+int slot_map_first(slot_map *map) {
+  while (map->first_word < map->num_of_words && map->words[map->first_word] == 0) map->first_word++;
+  if (map->first_word == map->num_of_words) return -1;
+  return map->first_word * 64 + __builtin_ctzll(map->words[map->first_word]);
 }
 
 /**
  * @brief
- * Find the first available block
- * according to the g_bitmap.
- * @return The ID of the first free block.
+ * Find the first taken slot at or after a slot.
+ * @param map The slot map.
+ * @param from The slot to start from.
+ * @param num_of_slots The number of slots of the table.
+ * @return The slot, if any is taken.
+ * @return num_of_slots, otherwise.
  */
-int bitmap_find_first_available_block() {
-  for (int i = 0; i < FILE_SYSTEM_SIZE; i++)
-    if (bitmap_is_block_free(i)) return i;
-  return -1;
+int slot_map_next_taken(slot_map *map, int from, int num_of_slots) {
+  for (int w = from / 64; w < map->num_of_words; w++) {
+    uint64_t taken = ~map->words[w];
+    if (w == from / 64) taken &= ~(uint64_t)0 << (from % 64);
+    if (taken != 0) return min(num_of_slots, w * 64 + __builtin_ctzll(taken));
+  }
+  return num_of_slots;
 }
 #pragma endregion
 
-#pragma region Flushing Utils
+#pragma region Stats Utils
+/**
+ * @brief
+ * Add to a counter of g_stats.
+ * @param counter The counter.
+ * @param n The amount to add.
+ */
+void stats_add(long long *counter, long long n) { __atomic_fetch_add(counter, n, __ATOMIC_RELAXED); }
+
 /**
  * @brief
- * Flush the cached i-Node table to the disk.
+ * Read the monotonic clock.
+ * @return The time, in nanoseconds.
  */
-void flush_i_node_table() {
-  void *buffer = write_data_to_a_buffer(g_inode_table, NUM_OF_I_NODES * sizeof(i_node));
-  write_blocks(I_NODE_TABLE_START, I_NODE_TABLE_LENGTH, buffer);
-  free(buffer);
+long long stats_clock_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 /**
  * @brief
- * Flush the root directory table to the disk.
+ * Record the latency of a call in its histogram.
+ * @param op The call, one of the SFS_OP_* constants.
+ * @param start_ns When the call started, from stats_clock_ns().
  */
-void flush_root_directory_table() {
-  void *buffer = write_data_to_a_buffer(g_root_directory_table, NUM_OF_FILES * sizeof(directory_entry));
-  write_blocks(ROOT_DIRECTORY_START, ROOT_DIRECTORY_LENGTH, buffer);
-  free(buffer);
+void stats_record_latency(int op, long long start_ns) {
+  long long us = (stats_clock_ns() - start_ns) / 1000;
+  sfs_latency_histogram *histogram = &g_stats.latency[op];
+  int bucket = us == 0 ? 0 : min(SFS_LATENCY_BUCKETS - 1, 64 - __builtin_clzll((unsigned long long)us));
+  stats_add(&histogram->count, 1);
+  stats_add(&histogram->total_us, us);
+  stats_add(&histogram->buckets[bucket], 1);
+
+  long long max_us = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+  while (us > max_us &&
+         !__atomic_compare_exchange_n(&histogram->max_us, &max_us, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
 }
 
 /**
  * @brief
- * Flush the cached g_bitmap to the disk.
+ * Append formatted text to a buffer, the
+ * way snprintf() would write it. Whatever
+ * does not fit is counted, but not written.
+ * @param buf The buffer, or NULL to only count.
+ * @param size The size of the buffer, in bytes.
+ * @param length The length of the text so far.
+ * @param format The format of the text to append.
+ * @return The length of the text with the appended part.
  */
-void flush_bitmap() {
-  void *buffer = write_data_to_a_buffer(g_bitmap, FILE_SYSTEM_SIZE / 8);
-  write_blocks(BITMAP_START, BITMAP_LENGTH, buffer);
-  free(buffer);
+int stats_append(char *buf, int size, int length, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int offset = min(length, max(0, size - 1));
+  int n = vsnprintf(buf == NULL ? NULL : buf + offset, buf == NULL ? 0 : size - offset, format, args);
+  va_end(args);
+  return length + max(0, n);
 }
 #pragma endregion
 
-#pragma region Root Dir Utils
+#pragma region Buffer Pool Utils
 /**
  * @brief
- * Get the directory entry by the filename.
- * @param filename The filename.
- * @returns A pointer to the directory entry, if found.
- * @returns NULL, if not.
+ * Allocate a buffer aligned to BUFFER_ALIGNMENT.
+ * @param size The size of the buffer, in bytes.
+ * @return The buffer, NULL if out of memory.
  */
-directory_entry *root_get_directory_entry(const char *filename) {
-  for (int i = 0; i < NUM_OF_FILES; i++)
-    if (g_root_directory_table[i].i_node_id != -1 && strcmp(g_root_directory_table[i].file_name, filename) == 0)
-      return &g_root_directory_table[i];
-  return NULL;
+char *buffer_alloc_aligned(size_t size) {
+  void *buffer = NULL;
+  if (posix_memalign(&buffer, BUFFER_ALIGNMENT, size > 0 ? size : 1) != 0) return NULL;
+  return (char *)buffer;
 }
 
 /**
  * @brief
- * Get the directory entry of a file
- * given its inode.
- * @param inode_idx The iNode ID.
- * @return Its directory entry.
+ * Take an I/O buffer out of the pool, reusing
+ * the smallest idle one that is large enough,
+ * or growing an idle one. When every pooled
+ * buffer is in use, a buffer of its own is
+ * allocated, and freed when it is put back.
+ * @param size The size needed, in bytes.
+ * @return The buffer, aligned to BUFFER_ALIGNMENT.
  */
-directory_entry *root_get_directory_entry_via_inode(int inode_idx) {
-  for (int i = 0; i < NUM_OF_FILES; i++)
-    if (g_root_directory_table[i].i_node_id == inode_idx) return &g_root_directory_table[i];
-  return NULL;
+char *buffer_pool_get(size_t size) {
+  pthread_mutex_lock(&g_pool_lock);
+  int best = -1;
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+    pooled_buffer *candidate = &g_buffer_pool[i];
+    if (candidate->in_use) continue;
+    if (best == -1) {
+      best = i;
+      continue;
+    }
+    bool fits = candidate->size >= size, best_fits = g_buffer_pool[best].size >= size;
+    if ((fits && (!best_fits || candidate->size < g_buffer_pool[best].size)) ||
+        (!fits && !best_fits && candidate->size > g_buffer_pool[best].size))
+      best = i;
+  }
+  if (best == -1) {
+    pthread_mutex_unlock(&g_pool_lock);
+    return buffer_alloc_aligned(size);
+  }
+
+  pooled_buffer *buffer = &g_buffer_pool[best];
+  if (buffer->size < size) {
+    free(buffer->data);
+    buffer->data = buffer_alloc_aligned(size);
+    buffer->size = buffer->data == NULL ? 0 : size;
+  }
+  buffer->in_use = buffer->data != NULL;
+  char *data = buffer->data;
+  pthread_mutex_unlock(&g_pool_lock);
+  return data;
 }
 
 /**
  * @brief
- * Get the number of files in the root.
- * @return The number of files.
+ * Give a buffer from buffer_pool_get() back.
+ * @param data The buffer.
  */
-int root_count_number_of_files() {
-  int result = 0;
-  for (int i = 0; i < NUM_OF_FILES; i++)
-    if (g_root_directory_table[i].i_node_id != -1) result++;
-  return result;
+void buffer_pool_put(char *data) {
+  if (data == NULL) return;
+  pthread_mutex_lock(&g_pool_lock);
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++)
+    if (g_buffer_pool[i].in_use && g_buffer_pool[i].data == data) {
+      g_buffer_pool[i].in_use = false;
+      pthread_mutex_unlock(&g_pool_lock);
+      return;
+    }
+  pthread_mutex_unlock(&g_pool_lock);
+  free(data);
 }
+#pragma endregion
 
+#pragma region Block Cache Utils
 /**
  * @brief
- * Get the directory entry
- * of the ith file in the root.
- * @param i Index.
- * @return The ith directory entry.
+ * Reset the block cache to the empty state.
+ * Dirty blocks are discarded, so flush first
+ * if their contents still matter. Call it after
+ * the geometry is known.
  */
-directory_entry *root_get_ith_file(int i) {
-  int count = 0;
-  for (int j = 0; j < NUM_OF_FILES; ++j)
-    if (g_root_directory_table[j].i_node_id != -1 && count++ == i) return &g_root_directory_table[i];
-  return NULL;
+void cache_init() {
+  for (int i = 0; i < CACHE_NUM_OF_SLOTS; i++) {
+    // The slots are resized along with the block size, and aligned
+    // so that evicting one needs no bounce buffer on O_DIRECT.
+    free(g_cache[i].data);
+    g_cache[i].data = buffer_alloc_aligned(FILE_SYSTEM_BLOCK_SIZE);
+    g_cache[i].block_id = -1;
+    g_cache[i].dirty = false;
+    g_cache[i].referenced = false;
+    g_cache[i].hash_next = -1;
+  }
+  for (int i = 0; i < CACHE_HASH_SIZE; i++) g_cache_hash[i] = -1;
+  g_cache_clock_hand = 0;
+  g_cache_num_of_dirty_slots = 0;
 }
 
 /**
  * @brief
- * Find the first available
- * directory entry in the
- * root directory table.
- * @return The index of the available entry.
+ * Find the cache slot holding the specified block.
+ * @param block_id The ID of the block.
+ * @returns The index of the slot, if cached.
+ * @returns -1, if not.
  */
-int root_get_first_available_directory_entry() {
-  for (int i = 0; i < NUM_OF_FILES; i++)
-    if (g_root_directory_table[i].i_node_id == -1) return i;
+int cache_lookup(int block_id) {
+  for (int i = g_cache_hash[block_id & (CACHE_HASH_SIZE - 1)]; i != -1; i = g_cache[i].hash_next)
+    if (g_cache[i].block_id == block_id) return i;
   return -1;
 }
-#pragma endregion
 
-#pragma region iNode Utils
 /**
  * @brief
- * Get the first vacant i-Node.
- * @return The ID to the first available iNode.
+ * Unlink a slot from its hash chain.
+ * @param slot_idx The index of the slot.
  */
-int inode_tab_get_first_available_entry() {
-  for (int i = 0; i < NUM_OF_I_NODES; ++i)
-    if (g_inode_table[i].size == -1) return i;
-  return -1;
+void cache_unlink_slot(int slot_idx) {
+  int *link = &g_cache_hash[g_cache[slot_idx].block_id & (CACHE_HASH_SIZE - 1)];
+  while (*link != slot_idx) link = &g_cache[*link].hash_next;
+  *link = g_cache[slot_idx].hash_next;
+  g_cache[slot_idx].hash_next = -1;
 }
 
 /**
  * @brief
- * Get the block ID of the specified page offset.
- * @param node The iNode to investigate.
- * @param loc The page offset, the offset starts from 0.
- * @returns The block ID which should contain the offset.
- * @returns -1, if cannot find the block ID.
+ * Pick a victim slot with the CLOCK algorithm,
+ * writing it back to the disk if it is dirty.
+ * @return The index of the vacated slot.
  */
-int inode_get_block_id_by_offset(i_node *node, int loc) {
-  int file_size = node->size;
-  int indirect_ptr = node->indirect_pointer;
-  int indirect_block[INDIRECT_BLOCK_SIZE];
+int cache_evict_a_slot() {
+  while (true) {
+    cache_slot *slot = &g_cache[g_cache_clock_hand];
+    int slot_idx = g_cache_clock_hand;
+    g_cache_clock_hand = (g_cache_clock_hand + 1) % CACHE_NUM_OF_SLOTS;
+
+    if (slot->block_id != -1 && slot->referenced) {
+      // Give recently used blocks a second chance.
+      slot->referenced = false;
+      continue;
+    }
 
-  if ((calculate_block_length(file_size) * FILE_SYSTEM_BLOCK_SIZE) <= loc) {
-    print_error("Trying to access memory that does not belong to the file.");
-    return -1;
-  } else if (loc < 12 * FILE_SYSTEM_BLOCK_SIZE)
-    // The block should be in the direct pointers.
-    return node->direct_pointers[loc / FILE_SYSTEM_BLOCK_SIZE];
-  else {
-    // The block should be in the indirect pointers.
-    read_blocks(indirect_ptr, 1, indirect_block);
-    return indirect_block[(loc - 12 * FILE_SYSTEM_BLOCK_SIZE) / FILE_SYSTEM_BLOCK_SIZE];
+    if (slot->block_id != -1) {
+      if (slot->dirty) {
+        write_blocks(slot->block_id, 1, slot->data);
+        slot->dirty = false;
+        g_cache_num_of_dirty_slots--;
+      }
+      cache_unlink_slot(slot_idx);
+      slot->block_id = -1;
+    }
+    return slot_idx;
   }
 }
 
 /**
  * @brief
- * Assign a new block to an i-Node.
- * @param node An i-Node.
- * @return The assigned block ID.
- */
-int inode_assign_new_block(i_node *node) {
-  int vac_block = bitmap_find_first_available_block();
-  bitmap_occupy_a_block(vac_block);
-  if (vac_block == -1) return -1;
-
-  // Try to assign to the direct pointers.
-  for (int i = 0; i < 12; ++i)
-    if (node->direct_pointers[i] == -1) {
-      node->direct_pointers[i] = vac_block;
-      return vac_block;
-    }
-
-  // Try to assign to indirect blocks;
-  int indirect_block[INDIRECT_BLOCK_SIZE];
-  if (node->indirect_pointer == -1) {
-    // If the indirect does not exist.
-    node->indirect_pointer = bitmap_find_first_available_block();
-    bitmap_occupy_a_block(node->indirect_pointer);
-    for (int i = 0; i < INDIRECT_BLOCK_SIZE; i++) indirect_block[i] = -1;
-    indirect_block[0] = vac_block;
-  } else {
-    // If the indirect block exists.
-    read_blocks(node->indirect_pointer, 1, indirect_block);
-    int i = 0;
-    for (; i < INDIRECT_BLOCK_SIZE - 1 && indirect_block[i + 1] != -1; ++i)
-      ;
-    if (i == INDIRECT_BLOCK_SIZE - 1) {
-      print_error("The file has consumed all available iNode space.");
-      return -1;
+ * Bind a vacant slot to the specified block.
+ * The contents of the slot are left undefined.
+ * @param block_id The ID of the block.
+ * @return The index of the slot.
+ */
+int cache_insert(int block_id) {
+  int slot_idx = cache_evict_a_slot();
+  cache_slot *slot = &g_cache[slot_idx];
+  int *head = &g_cache_hash[block_id & (CACHE_HASH_SIZE - 1)];
+  slot->block_id = block_id;
+  slot->referenced = true;
+  slot->hash_next = *head;
+  *head = slot_idx;
+  return slot_idx;
+}
+
+/**
+ * @brief
+ * Read a run of blocks missing from the cache off
+ * the disk, leaving the cache unlocked meanwhile,
+ * and insert the ones still missing afterwards.
+ * Blocks cached in the meantime are newer than
+ * the disk, and are copied to the buffer instead.
+ * Call it with g_cache_lock held.
+ * @param start_address The ID of the first block.
+ * @param nblocks The number of blocks to read.
+ * @param buffer The buffer to which the blocks are read.
+ * @param referenced Whether the inserted slots count as recently used.
+ */
+void cache_fill_run(int start_address, int nblocks, char *buffer, bool referenced) {
+  pthread_mutex_unlock(&g_cache_lock);
+  read_blocks(start_address, nblocks, buffer);
+  pthread_mutex_lock(&g_cache_lock);
+
+  for (int i = 0; i < nblocks; i++) {
+    int slot_idx = cache_lookup(start_address + i);
+    if (slot_idx != -1) {
+      memcpy(buffer + i * FILE_SYSTEM_BLOCK_SIZE, g_cache[slot_idx].data, FILE_SYSTEM_BLOCK_SIZE);
+      continue;
     }
-    indirect_block[i + 1] = vac_block;
+    slot_idx = cache_insert(start_address + i);
+    memcpy(g_cache[slot_idx].data, buffer + i * FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_BLOCK_SIZE);
+    g_cache[slot_idx].referenced = referenced;
   }
-
-  // Flush cached data structures to the disk.
-  write_blocks(node->indirect_pointer, 1, indirect_block);
-  flush_bitmap();
-  flush_i_node_table();
-  return vac_block;
 }
 
 /**
  * @brief
- * Clear an i-Node completely, which
- * means to restore its initial state
- * and to deallocate all associated
- * memory.
- * @param i_node_id The i-Node ID of the i-Node to clear.
+ * Read a series of blocks through the cache.
+ * Consecutive misses are fetched from the disk
+ * with a single read. Callers keep writers of
+ * the blocks out, through the lock of the
+ * i-Node or the table owning them.
+ * @param start_address The ID of the first block.
+ * @param nblocks The number of blocks to read.
+ * @param buffer The buffer to which the blocks are copied.
  */
-void inode_reset(int i_node_id) {
-  i_node *node = &g_inode_table[i_node_id];
-  node->mode = 0x777;
-  node->gid = -1;
-  node->uid = -1;
-  node->link_count = 0;
-  node->size = -1;
+void cache_read_blocks(int start_address, int nblocks, void *buffer) {
+  pthread_mutex_lock(&g_cache_lock);
+  char *dst = (char *)buffer;
+  int i = 0;
+  while (i < nblocks) {
+    int slot_idx = cache_lookup(start_address + i);
+    if (slot_idx != -1) {
+      memcpy(dst + i * FILE_SYSTEM_BLOCK_SIZE, g_cache[slot_idx].data, FILE_SYSTEM_BLOCK_SIZE);
+      g_cache[slot_idx].referenced = true;
+      stats_add(&g_stats.cache_hits, 1);
+      i++;
+      continue;
+    }
 
-  // Clear the direct pointers.
-  for (int i = 0; i < 12 && node->direct_pointers[i] != -1; i++) {
-    bitmap_free_a_block(node->direct_pointers[i]);
-    node->direct_pointers[i] = -1;
+    // Gather the run of missing blocks.
+    int run = 1;
+    while (i + run < nblocks && cache_lookup(start_address + i + run) == -1) run++;
+
+    // A memory-mapped disk already is a cache, so copy
+    // straight out of it instead of filling our own slots.
+    const char *mapped = (const char *)map_blocks(start_address + i, run);
+    if (mapped != NULL) {
+      memcpy(dst + i * FILE_SYSTEM_BLOCK_SIZE, mapped, run * FILE_SYSTEM_BLOCK_SIZE);
+      stats_add(&g_stats.cache_hits, run);
+      i += run;
+      continue;
+    }
+
+    // Otherwise read the run in one go.
+    stats_add(&g_stats.cache_misses, run);
+    cache_fill_run(start_address + i, run, dst + i * FILE_SYSTEM_BLOCK_SIZE, true);
+    i += run;
   }
+  pthread_mutex_unlock(&g_cache_lock);
+}
 
-  // Clear indirect pointers.
-  if (node->indirect_pointer != -1) {
-    int indirect_block[INDIRECT_BLOCK_SIZE];
-    read_blocks(node->indirect_pointer, 1, indirect_block);
+/**
+ * @brief
+ * Write a series of blocks through the cache.
+ * Blocks are only marked dirty, and reach the
+ * disk on eviction or on the next cache_flush().
+ * Long runs bypass the cache and are written
+ * directly, so that they do not wash out the
+ * blocks that are actually reused.
+ * @param start_address The ID of the first block.
+ * @param nblocks The number of blocks to write.
+ * @param buffer The buffer containing the blocks.
+ */
+void cache_write_blocks(int start_address, int nblocks, const void *buffer) {
+  pthread_mutex_lock(&g_cache_lock);
+  const char *src = (const char *)buffer;
+
+  if (nblocks > CACHE_WRITE_AROUND_THRESHOLD) {
+    write_blocks(start_address, nblocks, (void *)src);
+    // Keep any cached copies coherent with the disk.
+    for (int i = 0; i < nblocks; i++) {
+      int slot_idx = cache_lookup(start_address + i);
+      if (slot_idx == -1) continue;
+      memcpy(g_cache[slot_idx].data, src + i * FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_BLOCK_SIZE);
+      if (g_cache[slot_idx].dirty) {
+        g_cache[slot_idx].dirty = false;
+        g_cache_num_of_dirty_slots--;
+      }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return;
+  }
 
-    for (int i = 0; i < INDIRECT_BLOCK_SIZE && indirect_block[i] != -1; i++) bitmap_free_a_block(indirect_block[i]);
+  for (int i = 0; i < nblocks; i++) {
+    int slot_idx = cache_lookup(start_address + i);
+    if (slot_idx == -1) slot_idx = cache_insert(start_address + i);
 
-    node->indirect_pointer = -1;
+    cache_slot *slot = &g_cache[slot_idx];
+    memcpy(slot->data, src + i * FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_BLOCK_SIZE);
+    slot->referenced = true;
+    if (!slot->dirty) {
+      slot->dirty = true;
+      g_cache_num_of_dirty_slots++;
+    }
   }
-
-  // Flush all memory changes to the disk.
-  flush_bitmap();
-  flush_i_node_table();
+  pthread_mutex_unlock(&g_cache_lock);
 }
-#pragma endregion
 
-#pragma region FDT Utils
 /**
  * @brief
- * Find the first vacant entry in the FDT.
- * @return The ID of the available entry.
+ * Write zeros to a series of blocks through the
+ * cache, writing the blocks adjacent on the disk
+ * together.
+ * @param block_ids The IDs of the blocks.
+ * @param count The number of blocks.
  */
-int fdt_get_first_available_entry() {
-  for (int i = 0; i < NUM_OF_FILES; ++i)
-    if (g_fdt[i].i_node_idx == -1) return i;
-  return -1;
+void cache_zero_blocks(const int *block_ids, int count) {
+  int chunk = min(count, CACHE_NUM_OF_SLOTS);
+  char *zeros = buffer_pool_get(chunk * FILE_SYSTEM_BLOCK_SIZE);
+  memset(zeros, 0, chunk * FILE_SYSTEM_BLOCK_SIZE);
+  for (int i = 0, run; i < count; i += run) {
+    for (run = 1; run < chunk && i + run < count && block_ids[i + run] == block_ids[i] + run; run++)
+      ;
+    cache_write_blocks(block_ids[i], run, zeros);
+  }
+  buffer_pool_put(zeros);
 }
 
 /**
  * @brief
- * Determine if the file has already
- * been opened. If it has, then simple
- * return its file descriptor, otherwise
- * return -1.
- * @param filename The filename.
- * @return fd, if opened.
- * @return -1, otherwise.
+ * Bring a series of blocks into the cache ahead
+ * of use, reading each run of misses with a single
+ * read. Prefetched blocks are left unreferenced, so
+ * CLOCK evicts them first if they are never used.
+ * @param start_address The ID of the first block.
+ * @param nblocks The number of blocks to prefetch.
  */
-int fdt_get_fd_by_filename(const char *filename) {
-  for (int i = 0; i < NUM_OF_FILES; i++)
-    if (g_fdt[i].i_node_idx != -1) {
-      int inode_idx = g_fdt[i].i_node_idx;
-      if (strcmp(root_get_directory_entry_via_inode(inode_idx)->file_name, filename) == 0) return i;
+void cache_prefetch_blocks(int start_address, int nblocks) {
+  // A memory-mapped disk is read straight out of the mapping.
+  if (map_blocks(start_address, nblocks) != NULL) return;
+
+  // Never displace more than half of the cache at once.
+  nblocks = min(nblocks, CACHE_NUM_OF_SLOTS / 2);
+  char *buffer = NULL;
+  int i = 0;
+  pthread_mutex_lock(&g_cache_lock);
+  while (i < nblocks) {
+    if (cache_lookup(start_address + i) != -1) {
+      i++;
+      continue;
     }
-  return -1;
+
+    int run = 1;
+    while (i + run < nblocks && cache_lookup(start_address + i + run) == -1) run++;
+
+    if (buffer == NULL) buffer = buffer_pool_get(nblocks * FILE_SYSTEM_BLOCK_SIZE);
+    cache_fill_run(start_address + i, run, buffer, false);
+    i += run;
+  }
+  pthread_mutex_unlock(&g_cache_lock);
+  buffer_pool_put(buffer);
 }
-#pragma endregion
 
-#pragma region APIs
 /**
  * @brief
- * Initialize Simple File System.
- * If the flag is 1, we create the file system from scratch,
- * in accordance with the default settings.
- *
- * If the flag is 0, we read the super_block from the disk, and
- * initialize the file system accordingly.
- *
- * @param flag Indicate whether to create the file system from scratch.
+ * Compare two cache slot indices by their block IDs.
  */
-void mksfs(int flag) {
-  if (flag == 1) {
-    // Initialize the Simple File System from scratch.
-    I_NODE_TABLE_START = 1;
-    I_NODE_TABLE_LENGTH = calculate_block_length(NUM_OF_I_NODES * sizeof(i_node));
-    ROOT_DIRECTORY_START = I_NODE_TABLE_START + I_NODE_TABLE_LENGTH;
-    ROOT_DIRECTORY_LENGTH = calculate_block_length(NUM_OF_FILES * sizeof(directory_entry));
-    DATA_BLOCK_START = ROOT_DIRECTORY_START + ROOT_DIRECTORY_LENGTH;
-    BITMAP_LENGTH = calculate_block_length(NUM_OF_FILES / 8 + (NUM_OF_FILES % 8 > 0 ? 1 : 0));
-    BITMAP_START = FILE_SYSTEM_SIZE - BITMAP_LENGTH;
-    DATA_BLOCK_LENGTH = BITMAP_START - DATA_BLOCK_START;
-
-    // Init a fresh disk.
-    init_fresh_disk("sfs.txt", FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_SIZE);
-
-    struct super_block super_block = {.block_size = FILE_SYSTEM_BLOCK_SIZE,
-                                      .file_system_size = FILE_SYSTEM_SIZE,
-                                      .i_node_num = NUM_OF_I_NODES,
-                                      .i_node_table_length = I_NODE_TABLE_LENGTH,
-                                      .magic_number = 260917301,
-                                      .root_directory = ROOT_DIRECTORY_START};
-
-    // Save the super block.
-    char *buffer = write_data_to_a_buffer(&super_block, sizeof(super_block));
-    write_blocks(0, 1, buffer);
-    free(buffer);
+int cache_compare_slots_by_block_id(const void *a, const void *b) {
+  return g_cache[*(const int *)a].block_id - g_cache[*(const int *)b].block_id;
+}
 
-    // Save the initialized iNode table to disk.
-    for (int i = 0; i < NUM_OF_I_NODES; i++) {
-      g_inode_table[i].mode = 0x777;
-      g_inode_table[i].link_count = 0;
-      g_inode_table[i].uid = -1;
-      g_inode_table[i].gid = -1;
-      g_inode_table[i].size = -1;
-      for (int j = 0; j < 12; ++j) g_inode_table[i].direct_pointers[j] = -1;
-      g_inode_table[i].indirect_pointer = -1;
+/**
+ * @brief
+ * Write every dirty block back to the disk, along
+ * with runs of blocks that bypass the cache. Dirty
+ * blocks are sorted by their IDs, and each contiguous
+ * run is a single request. All the requests are
+ * submitted before any of them is waited for.
+ * @param runs The runs to write besides the dirty blocks.
+ * @param num_of_runs The number of runs.
+ * @return The number of writes issued.
+ */
+int cache_flush_with(block_request *runs, int num_of_runs) {
+  pthread_mutex_lock(&g_cache_lock);
+
+  // The runs supersede whatever the cache holds for their blocks.
+  for (int i = 0; i < num_of_runs; i++) {
+    for (int j = 0; j < runs[i].nblocks; j++) {
+      int slot_idx = cache_lookup(runs[i].start_address + j);
+      if (slot_idx == -1) continue;
+      memcpy(g_cache[slot_idx].data, (char *)runs[i].buffer + j * FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_BLOCK_SIZE);
+      if (g_cache[slot_idx].dirty) {
+        g_cache[slot_idx].dirty = false;
+        g_cache_num_of_dirty_slots--;
+      }
     }
+  }
 
-    // Initialize root iNode.
-    struct i_node *r = &g_inode_table[0];
-    r->size = NUM_OF_FILES * sizeof(directory_entry);
-    for (int i = 0; i < ROOT_DIRECTORY_LENGTH; i++) r->direct_pointers[i] = i + ROOT_DIRECTORY_START;
-
-    flush_i_node_table();
-
-    // Save the initialized root directory table to the disk.
-    for (int i = 0; i < NUM_OF_FILES; i++) {
-      g_root_directory_table[i].i_node_id = -1;
-      for (int j = 0; j < MAX_FILE_NAME_LENGTH + MAX_FILE_EXTENSION_LENGTH + 1; j++)
-        g_root_directory_table[i].file_name[j] = '\0';
+  int dirty_slots[CACHE_NUM_OF_SLOTS], num_of_dirty_slots = 0;
+  if (g_cache_num_of_dirty_slots > 0)
+    for (int i = 0; i < CACHE_NUM_OF_SLOTS; i++)
+      if (g_cache[i].block_id != -1 && g_cache[i].dirty) dirty_slots[num_of_dirty_slots++] = i;
+  if (num_of_runs == 0 && num_of_dirty_slots == 0) {
+    pthread_mutex_unlock(&g_cache_lock);
+    return 0;
+  }
+  qsort(dirty_slots, num_of_dirty_slots, sizeof(int), cache_compare_slots_by_block_id);
+
+  char *buffer = buffer_pool_get(max(1, num_of_dirty_slots) * FILE_SYSTEM_BLOCK_SIZE);
+  block_request *requests = (block_request *)malloc((num_of_runs + num_of_dirty_slots) * sizeof(block_request));
+  if (num_of_runs > 0) memcpy(requests, runs, num_of_runs * sizeof(block_request));
+  int num_of_requests = num_of_runs, i = 0;
+  while (i < num_of_dirty_slots) {
+    int run = 1;
+    while (i + run < num_of_dirty_slots &&
+           g_cache[dirty_slots[i + run]].block_id == g_cache[dirty_slots[i]].block_id + run)
+      run++;
+
+    for (int j = 0; j < run; j++) {
+      cache_slot *slot = &g_cache[dirty_slots[i + j]];
+      memcpy(buffer + (i + j) * FILE_SYSTEM_BLOCK_SIZE, slot->data, FILE_SYSTEM_BLOCK_SIZE);
+      slot->dirty = false;
     }
-    flush_root_directory_table();
+    requests[num_of_requests++] =
+        (block_request){1, g_cache[dirty_slots[i]].block_id, run, buffer + i * FILE_SYSTEM_BLOCK_SIZE, 0, 0};
+    i += run;
+  }
+  g_cache_num_of_dirty_slots = 0;
+
+  submit_blocks(requests, num_of_requests);
+  wait_blocks(requests, num_of_requests);
+  free(requests);
+  buffer_pool_put(buffer);
+  pthread_mutex_unlock(&g_cache_lock);
+  return num_of_requests;
+}
 
-    // Save the g_bitmap.
-    for (int i = 0; i < FILE_SYSTEM_SIZE / 8; ++i) g_bitmap[i] = 255;
-    for (int i = 0; i < DATA_BLOCK_START; i++) bitmap_occupy_a_block(i);
-    for (int i = BITMAP_START; i < FILE_SYSTEM_SIZE; i++) bitmap_occupy_a_block(i);
-    flush_bitmap();
+/**
+ * @brief
+ * Write every dirty block back to the disk.
+ * @return The number of writes issued.
+ */
+int cache_flush() { return cache_flush_with(NULL, 0); }
+#pragma endregion
 
-    // Initialize the FDT.
-    for (int i = 0; i < NUM_OF_FILES; i++) {
-      g_fdt[i].i_node_idx = -1;
-      g_fdt[i].read_write_pointer = -1;
-    }
-  } else {
-    // The Simple File System is already stored on disk,
-    // we should read from the disk to cache necessary
-    // contents.
-    // Initialize the Simple File System from scratch.
-    I_NODE_TABLE_START = 1;
-    I_NODE_TABLE_LENGTH = calculate_block_length(NUM_OF_I_NODES * sizeof(i_node));
-    ROOT_DIRECTORY_START = I_NODE_TABLE_START + I_NODE_TABLE_LENGTH;
-    ROOT_DIRECTORY_LENGTH = calculate_block_length(NUM_OF_FILES * sizeof(directory_entry));
-    DATA_BLOCK_START = ROOT_DIRECTORY_START + ROOT_DIRECTORY_LENGTH;
-    BITMAP_LENGTH = calculate_block_length(NUM_OF_FILES / 8 + NUM_OF_FILES % 8 > 0);
-    BITMAP_START = FILE_SYSTEM_SIZE - BITMAP_LENGTH;
-    DATA_BLOCK_LENGTH = BITMAP_START - DATA_BLOCK_START;
+#pragma region Flushing Utils
+/**
+ * @brief
+ * Describe an on-disk metadata region
+ * and reset its dirty state. The region
+ * starts with a copy of the whole table,
+ * unless the table is paged in later.
+ * @param region The region to initialize.
+ * @param start The first block of the region on the disk.
+ * @param length The number of blocks in the region.
+ * @param source The in-memory table saved in the region.
+ * @param data_size The size of the table, in bytes.
+ * @param is_loaded Whether the table is in memory already.
+ */
+void region_init(metadata_region *region, int start, int length, const void *source, int data_size,
+                 bool is_loaded) {
+  free(region->dirty_blocks);
+  free(region->data);
+  region->start = start;
+  region->length = length;
+  region->source = (const char *)source;
+  region->data = (char *)calloc(data_size, 1);
+  if (is_loaded) memcpy(region->data, source, data_size);
+  region->data_size = data_size;
+  region->dirty_blocks = (bool *)calloc(length, sizeof(bool));
+  region->num_of_dirty_blocks = 0;
+}
 
-    // Init an existing disk
-    init_disk("sfs.txt", FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_SIZE);
+/**
+ * @brief
+ * Bring the copy of a block of a metadata
+ * region up to date, after the block of
+ * the table is paged in.
+ * @param region The region.
+ * @param block_idx The block within the region.
+ */
+void region_load_block(metadata_region *region, int block_idx) {
+  int offset = block_idx * FILE_SYSTEM_BLOCK_SIZE, bytes = min(FILE_SYSTEM_BLOCK_SIZE, region->data_size - offset);
+  pthread_mutex_lock(&g_meta_lock);
+  memcpy(region->data + offset, region->source + offset, bytes);
+  pthread_mutex_unlock(&g_meta_lock);
+}
 
-    // Read iNode table.
-    void *buf = (void *)malloc(I_NODE_TABLE_LENGTH * FILE_SYSTEM_BLOCK_SIZE);
-    read_blocks(I_NODE_TABLE_START, I_NODE_TABLE_LENGTH, buf);
-    memcpy(g_inode_table, buf, sizeof(i_node) * NUM_OF_I_NODES);
-    free(buf);
+/**
+ * @brief
+ * Mark the blocks covering a byte range of
+ * a metadata region as dirty, leaving the copy
+ * of the table as it is. Call it with
+ * g_meta_lock held.
+ * @param region The region.
+ * @param offset The offset of the range within the region, in bytes.
+ * @param size The size of the range, in bytes.
+ */
+void region_mark_copy_dirty(metadata_region *region, int offset, int size) {
+  int first = offset / FILE_SYSTEM_BLOCK_SIZE, last = (offset + size - 1) / FILE_SYSTEM_BLOCK_SIZE;
+  for (int i = first; i <= last; i++)
+    if (!region->dirty_blocks[i]) {
+      region->dirty_blocks[i] = true;
+      region->num_of_dirty_blocks++;
+    }
+}
 
-    // Read root directory.
-    buf = (void *)malloc(ROOT_DIRECTORY_LENGTH * FILE_SYSTEM_BLOCK_SIZE);
-    read_blocks(ROOT_DIRECTORY_START, ROOT_DIRECTORY_LENGTH, buf);
-    memcpy(g_root_directory_table, buf, sizeof(directory_entry) * NUM_OF_FILES);
-    free(buf);
+/**
+ * @brief
+ * Mark the blocks covering a byte range
+ * of a metadata region as dirty, and take
+ * a copy of the range from the table. The
+ * caller holds the lock protecting the range,
+ * so the copy is consistent, and flushing
+ * never has to read the live table.
+ * @param region The region.
+ * @param offset The offset of the range within the region, in bytes.
+ * @param size The size of the range, in bytes.
+ */
+void region_mark_dirty(metadata_region *region, int offset, int size) {
+  pthread_mutex_lock(&g_meta_lock);
+  memcpy(region->data + offset, region->source + offset, size);
+  region_mark_copy_dirty(region, offset, size);
+  pthread_mutex_unlock(&g_meta_lock);
+}
 
-    // Read the g_bitmap.
-    buf = (void *)malloc(BITMAP_LENGTH * FILE_SYSTEM_BLOCK_SIZE);
-    read_blocks(BITMAP_START, BITMAP_LENGTH, buf);
-    memcpy(g_bitmap, buf, FILE_SYSTEM_BLOCK_SIZE / 8);
-    free(buf);
+/**
+ * @brief
+ * Mark a whole metadata region as dirty.
+ * @param region The region.
+ */
+void region_mark_all_dirty(metadata_region *region) { region_mark_dirty(region, 0, region->data_size); }
 
-    // Initialize the FDT.
-    for (int i = 0; i < NUM_OF_FILES; i++) {
-      g_fdt[i].i_node_idx = -1;
-      g_fdt[i].read_write_pointer = -1;
-    }
+/**
+ * @brief
+ * Take the images of the dirty blocks of a
+ * metadata region, and mark them clean.
+ * Call it with g_meta_lock held.
+ * @param region The region.
+ * @param block_ids The array to which the IDs of the blocks are written.
+ * @param images The buffer to which the images of the blocks are written.
+ * @return The number of blocks taken.
+ */
+int region_take_dirty_blocks(metadata_region *region, int *block_ids, char *images) {
+  int num_of_blocks = 0;
+  for (int i = 0; i < region->length && num_of_blocks < region->num_of_dirty_blocks; i++) {
+    if (!region->dirty_blocks[i]) continue;
+    region->dirty_blocks[i] = false;
+
+    // The last block of a region is usually only partially used.
+    char *image = images + num_of_blocks * FILE_SYSTEM_BLOCK_SIZE;
+    int offset = i * FILE_SYSTEM_BLOCK_SIZE, bytes = min(FILE_SYSTEM_BLOCK_SIZE, region->data_size - offset);
+    memcpy(image, region->data + offset, bytes);
+    memset(image + bytes, 0, FILE_SYSTEM_BLOCK_SIZE - bytes);
+    block_ids[num_of_blocks++] = region->start + i;
   }
+  region->num_of_dirty_blocks = 0;
+  return num_of_blocks;
 }
 
 /**
  * @brief
- * Get the name of the next file.
- *
- * @param result_buffer The buffer to which the method writes the result.
- * @return 1, if success.
- * @return -1, otherwise.
+ * Write the dirty blocks of a metadata region
+ * to the cache, one write per contiguous run.
+ * Call it with g_meta_lock held.
+ * @param region The region to flush.
  */
-int sfs_getnextfilename(char *result_buffer) {
-  int count_of_files = root_count_number_of_files();
-  if (count_of_files == 0)
-    return 0;
-  else if (root_file_counter == count_of_files) {
-    root_file_counter = 0;
-    return 0;
-  } else {
-    char *file_name = root_get_ith_file(root_file_counter++)->file_name;
-    strcpy(result_buffer, file_name);
-    return 1;
+void region_flush(metadata_region *region) {
+  if (region->num_of_dirty_blocks == 0) return;
+
+  int *block_ids = (int *)malloc(region->num_of_dirty_blocks * sizeof(int));
+  char *images = buffer_pool_get(region->num_of_dirty_blocks * FILE_SYSTEM_BLOCK_SIZE);
+  int num_of_blocks = region_take_dirty_blocks(region, block_ids, images);
+  for (int i = 0, run; i < num_of_blocks; i += run) {
+    for (run = 1; i + run < num_of_blocks && block_ids[i + run] == block_ids[i] + run; run++)
+      ;
+    cache_write_blocks(block_ids[i], run, images + i * FILE_SYSTEM_BLOCK_SIZE);
   }
+  buffer_pool_put(images);
+  free(block_ids);
 }
 
 /**
  * @brief
- * Get the file size of the specified file.
- *
- * @param filename The filename.
- * @return int, the file size if the file exists.
- * @return -1, if failed.
+ * Bind the dirty tracking of the i-Node table,
+ * the root directory and the g_bitmap to the
+ * current disk layout.
+ * @param is_inode_table_loaded Whether the i-Node table is in memory, rather than paged in on demand.
  */
-int sfs_getfilesize(const char *filename) {
-  directory_entry *result = root_get_directory_entry(filename);
-  return result == NULL ? -1 : g_inode_table[result->i_node_id].size;
+void metadata_regions_init(bool is_inode_table_loaded) {
+  region_init(&g_i_node_region, I_NODE_TABLE_START, I_NODE_TABLE_LENGTH, g_inode_table,
+              NUM_OF_I_NODES * sizeof(i_node), is_inode_table_loaded);
+  region_init(&g_root_directory_region, ROOT_DIRECTORY_START, ROOT_DIRECTORY_LENGTH, g_root_directory_table,
+              NUM_OF_FILES * sizeof(directory_entry), true);
+  region_init(&g_bitmap_region, BITMAP_START, BITMAP_LENGTH, g_bitmap, BITMAP_SIZE, true);
 }
 
 /**
  * @brief
- * If the file exists, bring it into the FDT.
- * If the file does not exist, create the file.
- *
- * @param filename The filename.
- * @return 1, if success.
- * @return 0, otherwise.
+ * Mark the on-disk copy of an i-Node as stale.
+ * @param i_node_id The ID of the i-Node.
  */
-int sfs_fopen(char *filename) {
-  // Test if the filename is too long.
-  // If it is. we should reject the request.
-  if (strlen(filename) > MAX_FILE_EXTENSION_LENGTH + MAX_FILE_NAME_LENGTH + 2) {
-    char msg[100];
-    sprintf(msg, "The filename is too long, with %lu bytes.", strlen(filename));
-    print_error(msg);
-    return -1;
-  }
+void inode_mark_dirty(int i_node_id) {
+  region_mark_dirty(&g_i_node_region, i_node_id * sizeof(i_node), sizeof(i_node));
+}
 
-  // Search through the FDT.
+/**
+ * @brief
+ * Mark the on-disk copy of a directory entry as stale.
+ * @param entry The directory entry.
+ */
+void root_mark_dirty(directory_entry *entry) {
+  region_mark_dirty(&g_root_directory_region, (entry - g_root_directory_table) * sizeof(directory_entry),
+                    sizeof(directory_entry));
+}
+
+/**
+ * @brief
+ * Write every dirty part of the i-Node table,
+ * the root directory and the g_bitmap to the cache.
+ * @return The number of blocks written.
+ */
+int flush_dirty_metadata() {
+  pthread_mutex_lock(&g_meta_lock);
+  int num_of_blocks = g_i_node_region.num_of_dirty_blocks + g_root_directory_region.num_of_dirty_blocks +
+                      g_bitmap_region.num_of_dirty_blocks;
+  region_flush(&g_i_node_region);
+  region_flush(&g_root_directory_region);
+  region_flush(&g_bitmap_region);
+  pthread_mutex_unlock(&g_meta_lock);
+  if (num_of_blocks > 0) {
+    stats_add(&g_stats.metadata_flushes, 1);
+    stats_add(&g_stats.metadata_blocks, num_of_blocks);
+  }
+  return num_of_blocks;
+}
+#pragma endregion
+
+#pragma region Journal Utils
+/**
+ * @brief
+ * Fold a buffer into an FNV-1a checksum.
+ * @param hash The checksum so far.
+ * @param data The buffer.
+ * @param size The size of the buffer, in bytes.
+ * @return The checksum with the buffer folded in.
+ */
+unsigned journal_checksum(unsigned hash, const char *data, int size) {
+  for (int i = 0; i < size; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+  return hash;
+}
+
+/**
+ * @brief
+ * The number of block images a single
+ * transaction can hold, bounded by both
+ * the journal and its descriptor block.
+ */
+int journal_capacity() {
+  int num_of_ids = (int)((FILE_SYSTEM_BLOCK_SIZE - sizeof(journal_header)) / sizeof(int));
+  return min(JOURNAL_LENGTH - 2, num_of_ids);
+}
+
+/**
+ * @brief
+ * Hold back a freed block until the running
+ * transaction commits, so that it cannot be
+ * reused while the disk still says it belongs
+ * to its old file. Call it with g_alloc_lock held.
+ * @param block_id The ID of the freed block.
+ */
+void journal_defer_free(int block_id) {
+  if (g_journal_num_of_freed_blocks == g_journal_freed_blocks_capacity) {
+    g_journal_freed_blocks_capacity = max(16, g_journal_freed_blocks_capacity * 2);
+    g_journal_freed_blocks = (int *)realloc(g_journal_freed_blocks, g_journal_freed_blocks_capacity * sizeof(int));
+  }
+  g_journal_freed_blocks[g_journal_num_of_freed_blocks++] = block_id;
+}
+
+/**
+ * @brief
+ * Write a transaction to the journal, and then
+ * its blocks to their homes. The data of the
+ * operations goes first, in the same batch as
+ * the descriptor and the images, so that it is
+ * on the disk before the commit record.
+ * @param block_ids The IDs of the blocks in the transaction.
+ * @param buffer The descriptor, the images and room for the commit record, in that order.
+ * @param num_of_blocks The number of blocks in the transaction.
+ * @param runs The runs of data blocks to write along.
+ * @param num_of_runs The number of runs.
+ */
+void journal_write_transaction(const int *block_ids, char *buffer, int num_of_blocks, block_request *runs,
+                               int num_of_runs) {
+  journal_header *descriptor = (journal_header *)buffer;
+  *descriptor = (journal_header){JOURNAL_MAGIC_NUMBER, g_journal_sequence, num_of_blocks, 0};
+  memcpy(buffer + sizeof(journal_header), block_ids, num_of_blocks * sizeof(int));
+
+  char *commit = buffer + (num_of_blocks + 1) * FILE_SYSTEM_BLOCK_SIZE;
+  memset(commit, 0, FILE_SYSTEM_BLOCK_SIZE);
+  *(journal_header *)commit =
+      (journal_header){JOURNAL_COMMIT_MAGIC_NUMBER, g_journal_sequence, num_of_blocks,
+                       journal_checksum(2166136261u, buffer, (num_of_blocks + 1) * FILE_SYSTEM_BLOCK_SIZE)};
+
+  block_request *requests = (block_request *)malloc((num_of_runs + num_of_blocks + 1) * sizeof(block_request));
+  if (num_of_runs > 0) memcpy(requests, runs, num_of_runs * sizeof(block_request));
+  requests[num_of_runs] = (block_request){1, JOURNAL_START, num_of_blocks + 1, buffer, 0, 0};
+  cache_flush_with(requests, num_of_runs + 1);
+  sync_disk();
+
+  write_blocks(JOURNAL_START + num_of_blocks + 1, 1, commit);
+  sync_disk();
+
+  // Checkpoint: the journal may only be reused once the blocks are home.
+  int num_of_requests = 0;
+  for (int i = 0, run; i < num_of_blocks; i += run) {
+    for (run = 1; i + run < num_of_blocks && block_ids[i + run] == block_ids[i] + run; run++)
+      ;
+    requests[num_of_requests++] =
+        (block_request){1, block_ids[i], run, buffer + (i + 1) * FILE_SYSTEM_BLOCK_SIZE, 0, 0};
+  }
+  cache_flush_with(requests, num_of_requests);
+  sync_disk();
+  free(requests);
+  g_journal_sequence++;
+  stats_add(&g_stats.journal_commits, 1);
+}
+
+/**
+ * @brief
+ * Commit the running transaction: every dirty
+ * block of the metadata tables, together with
+ * the data runs given. A transaction too large
+ * for the journal is written in place instead.
+ * Call it with g_journal_lock held.
+ * @param runs The runs of data blocks to write along.
+ * @param num_of_runs The number of runs.
+ */
+void journal_commit(block_request *runs, int num_of_runs) {
+  g_journal_num_of_ops = 0;
+
+  // Take over the blocks the transaction frees. They are free in
+  // the images already, and become allocatable once it commits.
+  pthread_mutex_lock(&g_alloc_lock);
+  pthread_mutex_lock(&g_meta_lock);
+  int *freed_blocks = g_journal_freed_blocks, num_of_freed_blocks = g_journal_num_of_freed_blocks;
+  g_journal_freed_blocks = NULL;
+  g_journal_num_of_freed_blocks = g_journal_freed_blocks_capacity = 0;
+  pthread_mutex_unlock(&g_alloc_lock);
+  for (int i = 0; i < num_of_freed_blocks; i++) {
+    g_bitmap_region.data[freed_blocks[i] / 8] |= 1 << (freed_blocks[i] % 8);
+    region_mark_copy_dirty(&g_bitmap_region, freed_blocks[i] / 8, 1);
+  }
+
+  int num_of_blocks = g_i_node_region.num_of_dirty_blocks + g_root_directory_region.num_of_dirty_blocks +
+                      g_bitmap_region.num_of_dirty_blocks;
+  if (num_of_blocks == 0) {
+    pthread_mutex_unlock(&g_meta_lock);
+    cache_flush_with(runs, num_of_runs);
+    return;
+  }
+  stats_add(&g_stats.metadata_flushes, 1);
+  stats_add(&g_stats.metadata_blocks, num_of_blocks);
+  if (num_of_blocks > journal_capacity()) {
+    region_flush(&g_i_node_region);
+    region_flush(&g_root_directory_region);
+    region_flush(&g_bitmap_region);
+    pthread_mutex_unlock(&g_meta_lock);
+    cache_flush_with(runs, num_of_runs);
+    sync_disk();
+  } else {
+    int *block_ids = (int *)malloc(num_of_blocks * sizeof(int));
+    char *buffer = buffer_pool_get((num_of_blocks + 2) * FILE_SYSTEM_BLOCK_SIZE);
+    char *images = buffer + FILE_SYSTEM_BLOCK_SIZE;
+    int n = region_take_dirty_blocks(&g_i_node_region, block_ids, images);
+    n += region_take_dirty_blocks(&g_root_directory_region, block_ids + n, images + n * FILE_SYSTEM_BLOCK_SIZE);
+    n += region_take_dirty_blocks(&g_bitmap_region, block_ids + n, images + n * FILE_SYSTEM_BLOCK_SIZE);
+    pthread_mutex_unlock(&g_meta_lock);
+    journal_write_transaction(block_ids, buffer, n, runs, num_of_runs);
+    buffer_pool_put(buffer);
+    free(block_ids);
+  }
+
+  // Release the freed blocks.
+  pthread_mutex_lock(&g_alloc_lock);
+  for (int i = 0; i < num_of_freed_blocks; i++) {
+    g_bitmap[freed_blocks[i] / 8] |= 1 << (freed_blocks[i] % 8);
+    g_bitmap_num_of_free_blocks++;
+    region_mark_dirty(&g_bitmap_region, freed_blocks[i] / 8, 1);
+  }
+  pthread_mutex_unlock(&g_alloc_lock);
+  free(freed_blocks);
+}
+
+/**
+ * @brief
+ * Redo the last transaction in the journal, if
+ * its commit record made it to the disk. Redoing
+ * one that was checkpointed already is harmless.
+ * Call it at mount, before the tables are read.
+ */
+void journal_replay() {
+  if (JOURNAL_LENGTH == 0) return;
+
+  char *descriptor = buffer_pool_get(FILE_SYSTEM_BLOCK_SIZE);
+  read_blocks(JOURNAL_START, 1, descriptor);
+  journal_header header = *(journal_header *)descriptor;
+  if (header.magic_number != JOURNAL_MAGIC_NUMBER || header.num_of_blocks < 1 ||
+      header.num_of_blocks > journal_capacity()) {
+    buffer_pool_put(descriptor);
+    return;
+  }
+  g_journal_sequence = header.sequence + 1;
+
+  int num_of_blocks = header.num_of_blocks;
+  char *images = buffer_pool_get((num_of_blocks + 1) * FILE_SYSTEM_BLOCK_SIZE);
+  read_blocks(JOURNAL_START + 1, num_of_blocks + 1, images);
+  journal_header commit = *(journal_header *)(images + num_of_blocks * FILE_SYSTEM_BLOCK_SIZE);
+  unsigned checksum = journal_checksum(2166136261u, descriptor, FILE_SYSTEM_BLOCK_SIZE);
+  checksum = journal_checksum(checksum, images, num_of_blocks * FILE_SYSTEM_BLOCK_SIZE);
+
+  if (commit.magic_number == JOURNAL_COMMIT_MAGIC_NUMBER && commit.sequence == header.sequence &&
+      commit.num_of_blocks == num_of_blocks && commit.checksum == checksum) {
+    const int *block_ids = (const int *)(descriptor + sizeof(journal_header));
+    for (int i = 0; i < num_of_blocks; i++)
+      if (block_ids[i] > 0 && block_ids[i] < FILE_SYSTEM_SIZE)
+        write_blocks(block_ids[i], 1, images + i * FILE_SYSTEM_BLOCK_SIZE);
+    sync_disk();
+  }
+  buffer_pool_put(images);
+  buffer_pool_put(descriptor);
+}
+
+/**
+ * @brief
+ * Commit the running transaction now.
+ */
+void journal_sync() {
+  if (JOURNAL_LENGTH == 0) return;
+  pthread_mutex_lock(&g_journal_lock);
+  journal_commit(NULL, 0);
+  pthread_mutex_unlock(&g_journal_lock);
+}
+
+/**
+ * @brief
+ * Finish an operation by pushing its changes
+ * to the disk, together with the given runs of
+ * data blocks, waiting for all of them at once.
+ *
+ * When writing through, the operation is durable
+ * when this returns: its journal transaction
+ * commits, or without a journal its metadata is
+ * written in place and the disk is synced.
+ *
+ * When writing back, its data stays in the cache
+ * and its metadata joins the running transaction,
+ * which commits once it groups enough operations
+ * or blocks, or frees blocks.
+ * @param runs The runs of data blocks the operation wrote around the cache.
+ * @param num_of_runs The number of runs.
+ */
+void commit_operation_with(block_request *runs, int num_of_runs) {
+  bool write_back = g_durability == SFS_WRITE_BACK;
+  if (JOURNAL_LENGTH == 0) {
+    if (write_back) {
+      if (num_of_runs > 0) cache_flush_with(runs, num_of_runs);
+      return;
+    }
+    int num_of_writes = flush_dirty_metadata();
+    num_of_writes += cache_flush_with(runs, num_of_runs);
+    if (num_of_writes > 0) sync_disk();
+    return;
+  }
+
+  pthread_mutex_lock(&g_journal_lock);
+  pthread_mutex_lock(&g_alloc_lock);
+  bool frees_blocks = g_journal_num_of_freed_blocks > 0;
+  pthread_mutex_unlock(&g_alloc_lock);
+  pthread_mutex_lock(&g_meta_lock);
+  int num_of_dirty_blocks = g_i_node_region.num_of_dirty_blocks + g_root_directory_region.num_of_dirty_blocks +
+                            g_bitmap_region.num_of_dirty_blocks;
+  pthread_mutex_unlock(&g_meta_lock);
+
+  if (!write_back || ++g_journal_num_of_ops >= JOURNAL_GROUP_COMMIT_OPS || frees_blocks ||
+      num_of_dirty_blocks >= journal_capacity() / 2)
+    journal_commit(runs, num_of_runs);
+  else if (num_of_runs > 0)
+    cache_flush_with(runs, num_of_runs);
+  pthread_mutex_unlock(&g_journal_lock);
+}
+
+/**
+ * @brief
+ * Finish an operation by pushing all of its
+ * metadata and data changes to the disk.
+ */
+void commit_operation() { commit_operation_with(NULL, 0); }
+
+/**
+ * @brief
+ * Make every finished operation durable,
+ * whatever the durability of the mount.
+ */
+void commit_operation_durably() {
+  if (JOURNAL_LENGTH > 0) {
+    journal_sync();
+  } else {
+    flush_dirty_metadata();
+    cache_flush();
+  }
+  // Blocks evicted from the cache were written, but not synced.
+  sync_disk();
+}
+
+/**
+ * @brief
+ * Finish one operation of a batch. The batch
+ * commits once, with commit_operation() at its
+ * end, unless its transaction grows to half
+ * the journal on the way, which then commits
+ * so that every transaction fits the journal.
+ */
+void commit_batch_step() {
+  if (JOURNAL_LENGTH == 0) return;
+  pthread_mutex_lock(&g_journal_lock);
+  pthread_mutex_lock(&g_meta_lock);
+  int num_of_dirty_blocks = g_i_node_region.num_of_dirty_blocks + g_root_directory_region.num_of_dirty_blocks +
+                            g_bitmap_region.num_of_dirty_blocks;
+  pthread_mutex_unlock(&g_meta_lock);
+  if (num_of_dirty_blocks >= journal_capacity() / 2) journal_commit(NULL, 0);
+  pthread_mutex_unlock(&g_journal_lock);
+}
+#pragma endregion
+
+#pragma region Bitmap Utils
+/**
+ * @brief
+ * Check whether the specified block is
+ * available according to the g_bitmap.
+ * @param block_id The ID of the block to investigate.
+ * @return True If free.
+ * @return False If occupied.
+ */
+bool bitmap_is_block_free(int block_id) {
+  int row_num = block_id / 8, column_num = block_id % 8;
+  return (g_bitmap[row_num] & (1 << column_num)) > 0;
+}
+
+/**
+ * @brief
+ * Free a block in the g_bitmap
+ * by setting it to 1. With a journal,
+ * that happens once the running
+ * transaction commits.
+ * @param block_id The ID of the block to free.
+ */
+void bitmap_free_a_block(int block_id) {
+  if (bitmap_is_block_free(block_id)) return;
+  if (JOURNAL_LENGTH > 0) {
+    journal_defer_free(block_id);
+    return;
+  }
+  int row_num = block_id / 8, column_num = block_id % 8;
+  g_bitmap[row_num] |= (1 << column_num);
+  g_bitmap_num_of_free_blocks++;
+  region_mark_dirty(&g_bitmap_region, row_num, 1);
+}
+
+/**
+ * @brief
+ * Occupy a block in the g_bitmap
+ * by setting it to 0.
+ * @param block_id The ID of the block to occupy.
+ */
+void bitmap_occupy_a_block(int block_id) {
+  if (!bitmap_is_block_free(block_id)) return;
+  int row_num = block_id / 8, column_num = block_id % 8;
+  g_bitmap[row_num] &= ~(1 << column_num);
+  g_bitmap_num_of_free_blocks--;
+  g_bitmap_next_fit = (block_id + 1) % FILE_SYSTEM_SIZE;
+  region_mark_dirty(&g_bitmap_region, row_num, 1);
+}
+
+/**
+ * @brief
+ * Load 64 consecutive bits of the g_bitmap,
+ * bit i standing for block 64 * word_idx + i.
+ * Bits past the end of the disk read as occupied.
+ * @param word_idx The index of the word.
+ * @return The word.
+ */
+uint64_t bitmap_load_word(int word_idx) {
+  uint64_t word = 0;
+  for (int i = 0; i < 8; i++) {
+    int row_num = word_idx * 8 + i;
+    if (row_num < BITMAP_SIZE) word |= (uint64_t)g_bitmap[row_num] << (8 * i);
+  }
+  int num_of_valid_bits = FILE_SYSTEM_SIZE - word_idx * 64;
+  if (num_of_valid_bits < 64) word &= ((uint64_t)1 << num_of_valid_bits) - 1;
+  return word;
+}
+
+/**
+ * @brief
+ * Find the first free block in [from, limit),
+ * examining 64 blocks at a time.
+ * @param from The first block to examine.
+ * @param limit One past the last block to examine.
+ * @return The ID of the free block.
+ * @return -1, if there is none.
+ */
+int bitmap_find_free_block_in_range(int from, int limit) {
+  for (int i = from; i < limit;) {
+    uint64_t word = bitmap_load_word(i / 64) >> (i % 64);
+    if (word != 0) {
+      int result = i + __builtin_ctzll(word);
+      return result < limit ? result : -1;
+    }
+    i += 64 - i % 64;
+  }
+  return -1;
+}
+
+/**
+ * @brief
+ * Measure the run of free blocks starting at
+ * the given block, examining 64 blocks at a time.
+ * @param start The first block of the run.
+ * @param max_length The length at which to stop measuring.
+ * @return The length of the run, at most max_length.
+ */
+int bitmap_measure_free_run(int start, int max_length) {
+  int length = 0;
+  while (length < max_length) {
+    int i = start + length;
+    uint64_t occupied = ~bitmap_load_word(i / 64) >> (i % 64);
+    if (occupied != 0) return min(max_length, length + __builtin_ctzll(occupied));
+    length += 64 - i % 64;
+  }
+  return max_length;
+}
+
+/**
+ * @brief
+ * Find an available block according to the g_bitmap,
+ * starting from where the last allocation left off.
+ * @return The ID of the free block.
+ * @return -1, if the disk is full.
+ */
+int bitmap_find_first_available_block() {
+  int result = bitmap_find_free_block_in_range(g_bitmap_next_fit, FILE_SYSTEM_SIZE);
+  return result != -1 ? result : bitmap_find_free_block_in_range(0, g_bitmap_next_fit);
+}
+
+/**
+ * @brief
+ * Count the free blocks in the g_bitmap.
+ * The count is maintained as blocks are freed
+ * and occupied, so this does not scan.
+ * @return The number of free blocks.
+ */
+int bitmap_count_free_blocks() { return g_bitmap_num_of_free_blocks; }
+
+/**
+ * @brief
+ * Reserve free blocks for data whose blocks are
+ * chosen later, or give a reservation back.
+ * @param delta The number of blocks to reserve, negative to give them back.
+ * @return true, if the blocks are reserved.
+ */
+bool bitmap_reserve_blocks(int delta) {
+  pthread_mutex_lock(&g_alloc_lock);
+  bool is_reserved = delta <= 0 || bitmap_count_free_blocks() - g_bitmap_num_of_reserved_blocks >= delta;
+  if (is_reserved) g_bitmap_num_of_reserved_blocks += delta;
+  pthread_mutex_unlock(&g_alloc_lock);
+  return is_reserved;
+}
+
+/**
+ * @brief
+ * Recompute the cached free block count and reset
+ * the next-fit cursor after the g_bitmap is loaded.
+ */
+void bitmap_recount() {
+  g_bitmap_num_of_free_blocks = 0;
+  for (int i = 0; i < (FILE_SYSTEM_SIZE + 63) / 64; i++)
+    g_bitmap_num_of_free_blocks += __builtin_popcountll(bitmap_load_word(i));
+  g_bitmap_next_fit = 0;
+}
+
+/**
+ * @brief
+ * Find a run of contiguous free blocks, starting
+ * from where the last allocation left off.
+ * The first run long enough is preferred;
+ * otherwise the longest run found is returned.
+ * @param wanted The desired length of the run.
+ * @param run_length Set to the actual length of the run, at most wanted.
+ * @return The ID of the first block of the run.
+ * @return -1, if no block is free.
+ */
+int bitmap_find_free_run(int wanted, int *run_length) {
+  int best_start = -1, best_length = 0;
+  for (int pass = 0; pass < 2 && best_length < wanted; pass++) {
+    int from = pass == 0 ? g_bitmap_next_fit : 0, limit = pass == 0 ? FILE_SYSTEM_SIZE : g_bitmap_next_fit;
+    for (int i = bitmap_find_free_block_in_range(from, limit); i != -1;) {
+      int length = bitmap_measure_free_run(i, min(wanted, limit - i));
+      if (length > best_length) {
+        best_start = i;
+        best_length = length;
+        if (length == wanted) break;
+      }
+      i = bitmap_find_free_block_in_range(i + length, limit);
+    }
+  }
+  *run_length = best_length;
+  return best_start;
+}
+#pragma endregion
+
+#pragma region Root Dir Utils
+/**
+ * @brief
+ * Hash a filename with FNV-1a.
+ * @param filename The filename.
+ * @return The bucket of the filename in the root index.
+ */
+int root_hash_filename(const char *filename) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *)filename; *c != '\0'; c++) hash = (hash ^ *c) * 16777619u;
+  return hash & (g_root_hash_size - 1);
+}
+
+/**
+ * @brief
+ * Add an occupied directory slot to the root index.
+ * @param slot_idx The index of the slot.
+ */
+void root_index_insert(int slot_idx) {
+  int *head = &g_root_hash_heads[root_hash_filename(g_root_directory_table[slot_idx].file_name)];
+  g_root_hash_next[slot_idx] = *head;
+  *head = slot_idx;
+  slot_map_take(&g_root_vacant_slots, slot_idx);
+}
+
+/**
+ * @brief
+ * Remove a directory slot from the root index.
+ * Must be called before the filename is cleared.
+ * @param slot_idx The index of the slot.
+ */
+void root_index_remove(int slot_idx) {
+  int *link = &g_root_hash_heads[root_hash_filename(g_root_directory_table[slot_idx].file_name)];
+  while (*link != -1 && *link != slot_idx) link = &g_root_hash_next[*link];
+  if (*link == slot_idx) *link = g_root_hash_next[slot_idx];
+  g_root_hash_next[slot_idx] = -1;
+  slot_map_release(&g_root_vacant_slots, slot_idx);
+}
+
+/**
+ * @brief
+ * Rebuild the root index from the
+ * cached root directory table.
+ */
+void root_index_rebuild() {
+  for (int i = 0; i < g_root_hash_size; i++) g_root_hash_heads[i] = -1;
+  slot_map_init(&g_root_vacant_slots, NUM_OF_FILES);
+  for (int i = 0; i < NUM_OF_FILES; i++) {
+    g_root_hash_next[i] = -1;
+    if (g_root_directory_table[i].i_node_id != -1)
+      root_index_insert(i);
+    else
+      slot_map_release(&g_root_vacant_slots, i);
+  }
+}
+
+/**
+ * @brief
+ * Get the directory entry by the filename.
+ * @param filename The filename.
+ * @returns A pointer to the directory entry, if found.
+ * @returns NULL, if not.
+ */
+directory_entry *root_get_directory_entry(const char *filename) {
+  for (int i = g_root_hash_heads[root_hash_filename(filename)]; i != -1; i = g_root_hash_next[i])
+    if (strcmp(g_root_directory_table[i].file_name, filename) == 0) return &g_root_directory_table[i];
+  return NULL;
+}
+
+/**
+ * @brief
+ * Get the next occupied directory entry
+ * at or after a slot cursor, and move the
+ * cursor past it.
+ * @param cursor The slot cursor.
+ * @returns The directory entry, if any.
+ * @returns NULL, if the end of the directory is reached.
+ */
+directory_entry *root_get_next_file(int *cursor) {
+  *cursor = slot_map_next_taken(&g_root_vacant_slots, *cursor, NUM_OF_FILES);
+  if (*cursor >= NUM_OF_FILES) return NULL;
+  return &g_root_directory_table[(*cursor)++];
+}
+
+/**
+ * @brief
+ * Reset every directory iteration.
+ */
+void root_iterators_init() {
+  root_file_counter = 0;
+  g_defrag_cursor = 0;
+  for (int i = 0; i < MAX_DIR_ITERATORS; i++) g_dir_iterators[i] = -1;
+}
+
+/**
+ * @brief
+ * Find the first available
+ * directory entry in the
+ * root directory table.
+ * @return The index of the available entry.
+ */
+int root_get_first_available_directory_entry() { return slot_map_first(&g_root_vacant_slots); }
+#pragma endregion
+
+#pragma region iNode Utils
+/**
+ * @brief
+ * Record the vacant i-Nodes of a series of
+ * blocks of the i-Node table, once they are
+ * in memory. Call it with g_load_lock held.
+ * @param first_block_idx The first block within the i-Node table.
+ * @param num_of_blocks The number of blocks.
+ */
+void inode_track_vacant_slots(int first_block_idx, int num_of_blocks) {
+  int per_block = FILE_SYSTEM_BLOCK_SIZE / (int)sizeof(i_node);
+  int end = min(NUM_OF_I_NODES, (first_block_idx + num_of_blocks) * per_block);
+  for (int i = first_block_idx * per_block; i < end; i++)
+    if (g_inode_table[i].size == -1) slot_map_release(&g_inode_vacant_slots, i);
+}
+
+/**
+ * @brief
+ * Page in a block of the i-Node table
+ * through the cache, unless another call
+ * did. Call it with g_load_lock held.
+ * @param block_idx The block within the i-Node table.
+ */
+void inode_load_block_locked(int block_idx) {
+  if (g_inode_blocks_loaded[block_idx]) return;
+  char block_data[FILE_SYSTEM_BLOCK_SIZE];
+  int offset = block_idx * FILE_SYSTEM_BLOCK_SIZE;
+  int bytes = min(FILE_SYSTEM_BLOCK_SIZE, NUM_OF_I_NODES * (int)sizeof(i_node) - offset);
+  cache_read_blocks(I_NODE_TABLE_START + block_idx, 1, block_data);
+  memcpy((char *)g_inode_table + offset, block_data, bytes);
+  region_load_block(&g_i_node_region, block_idx);
+  inode_track_vacant_slots(block_idx, 1);
+  __atomic_store_n(&g_inode_blocks_loaded[block_idx], true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief
+ * Page in a block of the i-Node table
+ * through the cache, unless another
+ * call just did.
+ * @param block_idx The block within the i-Node table.
+ */
+void inode_load_block(int block_idx) {
+  pthread_mutex_lock(&g_load_lock);
+  inode_load_block_locked(block_idx);
+  pthread_mutex_unlock(&g_load_lock);
+}
+
+/**
+ * @brief
+ * Get an i-Node. A mount reads none of the
+ * i-Node table, and each block of it is
+ * paged in the first time one of its
+ * i-Nodes is needed.
+ * @param i_node_id The ID of the i-Node.
+ * @return The i-Node.
+ */
+i_node *inode_get(int i_node_id) {
+  int block_idx = (int)((long long)i_node_id * sizeof(i_node) / FILE_SYSTEM_BLOCK_SIZE);
+  if (!__atomic_load_n(&g_inode_blocks_loaded[block_idx], __ATOMIC_ACQUIRE)) inode_load_block(block_idx);
+  return &g_inode_table[i_node_id];
+}
+
+/**
+ * @brief
+ * Get the first vacant i-Node.
+ * @return The ID to the first available iNode.
+ */
+int inode_tab_get_first_available_entry() {
+  // The vacant i-Nodes of the blocks not paged in yet are
+  // unknown, so page blocks in until one turns up.
+  pthread_mutex_lock(&g_load_lock);
+  int i_node_id = slot_map_first(&g_inode_vacant_slots);
+  while (i_node_id == -1 && g_inode_load_cursor < I_NODE_TABLE_LENGTH) {
+    inode_load_block_locked(g_inode_load_cursor++);
+    i_node_id = slot_map_first(&g_inode_vacant_slots);
+  }
+  pthread_mutex_unlock(&g_load_lock);
+  return i_node_id;
+}
+
+/**
+ * @brief
+ * Get the number of data blocks mapped by
+ * a pointer block of the specified level.
+ * Level 0 stands for a data block itself.
+ * @param level The level of the pointer block.
+ * @return long long The number of data blocks.
+ */
+long long inode_map_span(int level) {
+  long long span = 1;
+  for (int i = 0; i < level; i++) span *= INDIRECT_BLOCK_SIZE;
+  return span;
+}
+
+/**
+ * @brief
+ * Get the largest number of blocks a file can have,
+ * mapped by the direct pointers and the indirect,
+ * double indirect and triple indirect blocks.
+ * @return long long The number of blocks.
+ */
+long long inode_max_num_of_blocks() { return 12 + inode_map_span(1) + inode_map_span(2) + inode_map_span(3); }
+
+/**
+ * @brief
+ * Get the number of pointer blocks needed to
+ * map the first num_of_blocks blocks of a file.
+ * @param num_of_blocks The number of data blocks.
+ * @return long long The number of pointer blocks.
+ */
+long long inode_num_of_map_blocks(long long num_of_blocks) {
+  long long result = 0, remaining = num_of_blocks - 12;
+  for (int level = 1; level <= 3 && remaining > 0; level++) {
+    long long covered = remaining < inode_map_span(level) ? remaining : inode_map_span(level);
+    for (int l = 1; l <= level; l++) result += (covered + inode_map_span(l) - 1) / inode_map_span(l);
+    remaining -= covered;
+  }
+  return result;
+}
+
+/**
+ * @brief
+ * Walk down a tree of pointer blocks.
+ * @param pointer The root pointer block.
+ * @param level The level of the root pointer block.
+ * @param idx The index of the data block within the tree.
+ * @returns The ID of the data block.
+ * @returns -1, if the block is not mapped.
+ */
+int inode_map_lookup(int pointer, int level, long long idx) {
+  int pointer_block[INDIRECT_BLOCK_SIZE];
+  for (; level > 0 && pointer != -1; level--) {
+    cache_read_blocks(pointer, 1, pointer_block);
+    pointer = pointer_block[idx / inode_map_span(level - 1)];
+    idx %= inode_map_span(level - 1);
+  }
+  return pointer;
+}
+
+/**
+ * @brief
+ * Find the tree of pointer blocks mapping
+ * the specified block of a file.
+ * @param node The iNode to investigate.
+ * @param block_idx The index of the block within the file.
+ * @param root The root pointer block of the tree.
+ * @param idx The index of the block within the tree.
+ * @returns The level of the tree, which is 0 for a direct pointer.
+ * @returns -1, if the block is past the largest file.
+ */
+int inode_get_tree(i_node *node, int block_idx, int *root, long long *idx) {
+  if (block_idx < 12) return 0;
+
+  int roots[] = {node->indirect_pointer, node->double_indirect_pointer, node->triple_indirect_pointer};
+  *idx = block_idx - 12;
+  for (int level = 1; level <= 3; level++) {
+    if (*idx < inode_map_span(level)) {
+      *root = roots[level - 1];
+      return level;
+    }
+    *idx -= inode_map_span(level);
+  }
+  return -1;
+}
+
+/**
+ * @brief
+ * Get the block ID of the specified block of a file.
+ * @param node The iNode to investigate.
+ * @param block_idx The index of the block within the file.
+ * @returns The block ID.
+ * @returns -1, if the block is not mapped.
+ */
+int inode_get_block_id(i_node *node, int block_idx) {
+  int root;
+  long long idx;
+  int level = inode_get_tree(node, block_idx, &root, &idx);
+  if (level <= 0) return level == 0 ? node->direct_pointers[block_idx] : -1;
+  return inode_map_lookup(root, level, idx);
+}
+
+/**
+ * @brief
+ * Get the pointer block holding the block ID of
+ * the specified block of a file. The pointer
+ * blocks one level up are walked as if they
+ * were a tree of pointer blocks themselves.
+ * @param node The iNode to investigate.
+ * @param block_idx The index of the block within the file, past the direct pointers.
+ * @returns The block ID of the pointer block.
+ * @returns -1, if the block is not mapped.
+ */
+int inode_get_leaf_block_id(i_node *node, int block_idx) {
+  int root;
+  long long idx;
+  int level = inode_get_tree(node, block_idx, &root, &idx);
+  if (level <= 0) return -1;
+  return inode_map_lookup(root, level - 1, idx / INDIRECT_BLOCK_SIZE);
+}
+
+/**
+ * @brief
+ * Record a series of consecutive data blocks in a
+ * tree of pointer blocks, allocating the pointer
+ * blocks that do not exist yet. Every pointer block
+ * touched is read and written once.
+ * @param pointer The root pointer block, set if it gets allocated.
+ * @param level The level of the root pointer block.
+ * @param first_idx The index, within the tree, of the first data block.
+ * @param count The number of data blocks.
+ * @param block_ids The IDs of the data blocks.
+ */
+void inode_map_fill(int *pointer, int level, long long first_idx, int count, const int *block_ids) {
+  int pointer_block[INDIRECT_BLOCK_SIZE];
+  if (*pointer == -1) {
+    int run_length;
+    *pointer = bitmap_find_free_run(1, &run_length);
+    bitmap_occupy_a_block(*pointer);
+    for (int i = 0; i < INDIRECT_BLOCK_SIZE; i++) pointer_block[i] = -1;
+  } else
+    cache_read_blocks(*pointer, 1, pointer_block);
+
+  long long span = inode_map_span(level - 1);
+  for (int done = 0; done < count;) {
+    long long idx = first_idx + done;
+    int n = count - done < span - idx % span ? count - done : (int)(span - idx % span);
+    if (level == 1)
+      pointer_block[idx] = block_ids[done];
+    else
+      inode_map_fill(&pointer_block[idx / span], level - 1, idx % span, n, block_ids + done);
+    done += n;
+  }
+  cache_write_blocks(*pointer, 1, pointer_block);
+}
+
+/**
+ * @brief
+ * Free a tree of pointer blocks together
+ * with the data blocks it maps.
+ * @param pointer The root pointer block, or a data block at level 0.
+ * @param level The level of the root pointer block.
+ */
+void inode_map_free(int pointer, int level) {
+  if (pointer == -1) return;
+  if (level > 0) {
+    int pointer_block[INDIRECT_BLOCK_SIZE];
+    cache_read_blocks(pointer, 1, pointer_block);
+    for (int i = 0; i < INDIRECT_BLOCK_SIZE && pointer_block[i] != -1; i++)
+      inode_map_free(pointer_block[i], level - 1);
+  }
+  bitmap_free_a_block(pointer);
+}
+
+/**
+ * @brief
+ * Map a series of occupied blocks as the blocks
+ * of an i-Node from the specified one on, allocating
+ * the pointer blocks missing. Call it with
+ * g_alloc_lock held, and enough blocks free.
+ * @param node An i-Node.
+ * @param first_block_idx The index, within the file, of the first block.
+ * @param count The number of blocks.
+ * @param block_ids The IDs of the blocks, in file order.
+ */
+void inode_map_new_blocks(i_node *node, int first_block_idx, int count, const int *block_ids) {
+  // Fill the direct pointers first.
+  int i = 0;
+  for (; i < count && first_block_idx + i < 12; i++) node->direct_pointers[first_block_idx + i] = block_ids[i];
+
+  // The rest goes to the indirect, double indirect and triple indirect
+  // trees. The i-Node and the g_bitmap are written back when the
+  // operation commits.
+  int *roots[] = {&node->indirect_pointer, &node->double_indirect_pointer, &node->triple_indirect_pointer};
+  long long tree_start = 12;
+  for (int level = 1; level <= 3 && i < count; level++) {
+    long long tree_end = tree_start + inode_map_span(level);
+    if (first_block_idx + i < tree_end) {
+      int n = count - i < tree_end - (first_block_idx + i) ? count - i : (int)(tree_end - (first_block_idx + i));
+      inode_map_fill(roots[level - 1], level, first_block_idx + i - tree_start, n, block_ids + i);
+      i += n;
+    }
+    tree_start = tree_end;
+  }
+  inode_mark_dirty(node - g_inode_table);
+}
+
+/**
+ * @brief
+ * Assign a series of new blocks to an i-Node,
+ * taking them from as few contiguous runs of
+ * free blocks as possible. Either all of the
+ * blocks are assigned, or none of them is.
+ * @param node An i-Node.
+ * @param first_block_idx The index, within the file, of the first block to assign.
+ * @param count The number of blocks to assign.
+ * @param block_ids The array to which the assigned block IDs are written, in file order.
+ * @param reserved The blocks the caller reserved for them, given back once they are assigned.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int inode_assign_new_blocks(i_node *node, int first_block_idx, int count, int *block_ids, int reserved) {
+  if (first_block_idx + (long long)count > inode_max_num_of_blocks()) {
+    print_error("The file has consumed all available iNode space.");
+    return -1;
+  }
+
+  // The blocks of a file are always mapped from the start,
+  // so the pointer blocks needed are those mapping the
+  // new blocks and missing from the current tree.
+  long long num_of_map_blocks =
+      inode_num_of_map_blocks(first_block_idx + (long long)count) - inode_num_of_map_blocks(first_block_idx);
+  pthread_mutex_lock(&g_alloc_lock);
+  int num_of_unreserved_blocks = bitmap_count_free_blocks() - (g_bitmap_num_of_reserved_blocks - reserved);
+  if (num_of_unreserved_blocks < count + num_of_map_blocks) {
+    pthread_mutex_unlock(&g_alloc_lock);
+    return -1;
+  }
+  g_bitmap_num_of_reserved_blocks -= reserved;
+
+  // Carve the data blocks out of the longest free runs available.
+  for (int assigned = 0; assigned < count;) {
+    int run_length;
+    int run_start = bitmap_find_free_run(count - assigned, &run_length);
+    for (int i = 0; i < run_length; i++) {
+      bitmap_occupy_a_block(run_start + i);
+      block_ids[assigned++] = run_start + i;
+    }
+  }
+  inode_map_new_blocks(node, first_block_idx, count, block_ids);
+  pthread_mutex_unlock(&g_alloc_lock);
+  return 0;
+}
+
+/**
+ * @brief
+ * Get the data of a file kept in its i-Node.
+ * It takes the place of the block pointers,
+ * which a file with inline data does not use.
+ * @param node The i-Node.
+ * @return The I_NODE_INLINE_DATA_SIZE bytes of inline data.
+ */
+char *inode_inline_data(i_node *node) { return (char *)node + offsetof(i_node, direct_pointers); }
+
+/**
+ * @brief
+ * Make a vacant i-Node an empty file
+ * keeping its data inline.
+ * @param i_node_id The i-Node ID.
+ */
+void inode_init_inline(int i_node_id) {
+  pthread_mutex_lock(&g_load_lock);
+  slot_map_take(&g_inode_vacant_slots, i_node_id);
+  pthread_mutex_unlock(&g_load_lock);
+
+  i_node *node = inode_get(i_node_id);
+  node->size = 0;
+  node->flags = I_NODE_INLINE_DATA;
+  memset(inode_inline_data(node), 0, I_NODE_INLINE_DATA_SIZE);
+  inode_mark_dirty(i_node_id);
+}
+
+/**
+ * @brief
+ * Free the data blocks of a tree of pointer blocks
+ * from the specified index on, together with the
+ * pointer blocks left mapping nothing. Pointer
+ * blocks still mapping blocks before the index
+ * are read and written once.
+ * @param pointer The root pointer block, set to -1 if it is freed.
+ * @param level The level of the root pointer block.
+ * @param first_idx The index, within the tree, of the first data block to free.
+ */
+void inode_map_truncate(int *pointer, int level, long long first_idx) {
+  if (*pointer == -1) return;
+  if (first_idx == 0) {
+    inode_map_free(*pointer, level);
+    *pointer = -1;
+    return;
+  }
+
+  int pointer_block[INDIRECT_BLOCK_SIZE];
+  cache_read_blocks(*pointer, 1, pointer_block);
+  long long span = inode_map_span(level - 1);
+  int i = (int)(first_idx / span);
+  if (first_idx % span != 0) inode_map_truncate(&pointer_block[i++], level - 1, first_idx % span);
+  for (; i < INDIRECT_BLOCK_SIZE && pointer_block[i] != -1; i++) {
+    inode_map_free(pointer_block[i], level - 1);
+    pointer_block[i] = -1;
+  }
+  cache_write_blocks(*pointer, 1, pointer_block);
+}
+
+/**
+ * @brief
+ * Free the blocks of an i-Node from the
+ * specified block of the file on.
+ * @param i_node_id The i-Node ID.
+ * @param first_block_idx The index, within the file, of the first block to free.
+ */
+void inode_free_blocks_from(int i_node_id, int first_block_idx) {
+  i_node *node = inode_get(i_node_id);
+  if (node->flags & I_NODE_INLINE_DATA) return;
+  pthread_mutex_lock(&g_alloc_lock);
+
+  // Clear the direct pointers.
+  for (int i = first_block_idx; i < 12 && node->direct_pointers[i] != -1; i++) {
+    bitmap_free_a_block(node->direct_pointers[i]);
+    node->direct_pointers[i] = -1;
+  }
+
+  // Cut the indirect, double indirect and triple indirect trees.
+  int *roots[] = {&node->indirect_pointer, &node->double_indirect_pointer, &node->triple_indirect_pointer};
+  long long tree_start = 12;
+  for (int level = 1; level <= 3; level++) {
+    long long tree_end = tree_start + inode_map_span(level);
+    if (first_block_idx < tree_end)
+      inode_map_truncate(roots[level - 1], level, first_block_idx > tree_start ? first_block_idx - tree_start : 0);
+    tree_start = tree_end;
+  }
+  inode_mark_dirty(i_node_id);
+  pthread_mutex_unlock(&g_alloc_lock);
+}
+
+/**
+ * @brief
+ * Move the data blocks of a file into a single
+ * run of free blocks. The run is mapped by new
+ * pointer blocks, and the old blocks are freed,
+ * so that until the operation commits the disk
+ * still holds the old i-Node and its old tree.
+ * The caller holds the i-Node write locked, and
+ * flushes the tail and the delayed data first.
+ * @param i_node_id The i-Node ID.
+ * @return The number of blocks moved.
+ * @return 0, if the blocks are contiguous already, or no run of free blocks is long enough.
+ */
+int inode_relocate_blocks(int i_node_id) {
+  i_node *node = inode_get(i_node_id);
+  if (node->flags & I_NODE_INLINE_DATA) return 0;
+  int num_of_blocks = calculate_block_length(node->size);
+  if (num_of_blocks < 2) return 0;
+
+  int *old_ids = (int *)malloc(num_of_blocks * sizeof(int));
+  int num_of_runs = 1;
+  for (int i = 0; i < num_of_blocks; i++) {
+    old_ids[i] = inode_get_block_id(node, i);
+    if (i > 0 && old_ids[i] != old_ids[i - 1] + 1) num_of_runs++;
+  }
+
+  // Take the whole run at once, and reserve the pointer blocks mapping it.
+  int num_of_map_blocks = (int)inode_num_of_map_blocks(num_of_blocks);
+  int run_start = -1, run_length = 0;
+  pthread_mutex_lock(&g_alloc_lock);
+  if (num_of_runs > 1 &&
+      bitmap_count_free_blocks() - g_bitmap_num_of_reserved_blocks >= num_of_blocks + num_of_map_blocks)
+    run_start = bitmap_find_free_run(num_of_blocks, &run_length);
+  if (run_length < num_of_blocks) {
+    pthread_mutex_unlock(&g_alloc_lock);
+    free(old_ids);
+    return 0;
+  }
+  for (int i = 0; i < num_of_blocks; i++) bitmap_occupy_a_block(run_start + i);
+  g_bitmap_num_of_reserved_blocks += num_of_map_blocks;
+  pthread_mutex_unlock(&g_alloc_lock);
+
+  // Copy the data over, reading the blocks adjacent on the disk together.
+  int chunk = min(num_of_blocks, CACHE_NUM_OF_SLOTS);
+  char *buffer = buffer_pool_get(chunk * FILE_SYSTEM_BLOCK_SIZE);
+  for (int i = 0; i < num_of_blocks; i += chunk) {
+    int n = min(chunk, num_of_blocks - i);
+    for (int j = 0, run; j < n; j += run) {
+      for (run = 1; j + run < n && old_ids[i + j + run] == old_ids[i + j] + run; run++)
+        ;
+      cache_read_blocks(old_ids[i + j], run, buffer + j * FILE_SYSTEM_BLOCK_SIZE);
+    }
+    cache_write_blocks(run_start + i, n, buffer);
+  }
+  buffer_pool_put(buffer);
+
+  // Map the run with a tree of its own, then free the old one.
+  int *new_ids = old_ids;
+  i_node old_node = *node;
+  pthread_mutex_lock(&g_alloc_lock);
+  g_bitmap_num_of_reserved_blocks -= num_of_map_blocks;
+  for (int i = 0; i < 12; i++) node->direct_pointers[i] = -1;
+  node->indirect_pointer = -1;
+  node->double_indirect_pointer = -1;
+  node->triple_indirect_pointer = -1;
+  for (int i = 0; i < num_of_blocks; i++) new_ids[i] = run_start + i;
+  inode_map_new_blocks(node, 0, num_of_blocks, new_ids);
+  for (int i = 0; i < 12 && old_node.direct_pointers[i] != -1; i++) bitmap_free_a_block(old_node.direct_pointers[i]);
+  inode_map_free(old_node.indirect_pointer, 1);
+  inode_map_free(old_node.double_indirect_pointer, 2);
+  inode_map_free(old_node.triple_indirect_pointer, 3);
+  pthread_mutex_unlock(&g_alloc_lock);
+
+  free(old_ids);
+  return num_of_blocks;
+}
+
+/**
+ * @brief
+ * Clear an i-Node completely, which
+ * means to restore its initial state
+ * and to deallocate all associated
+ * memory.
+ * @param i_node_id The i-Node ID of the i-Node to clear.
+ */
+void inode_reset(int i_node_id) {
+  i_node *node = inode_get(i_node_id);
+  node->mode = 0x777;
+  node->gid = -1;
+  node->uid = -1;
+  node->link_count = 0;
+  node->size = -1;
+  inode_free_blocks_from(i_node_id, 0);
+
+  // Inline data sits where the pointers go.
+  if (node->flags & I_NODE_INLINE_DATA) {
+    node->flags = 0;
+    for (int i = 0; i < 12; ++i) node->direct_pointers[i] = -1;
+    node->indirect_pointer = -1;
+    node->double_indirect_pointer = -1;
+    node->triple_indirect_pointer = -1;
+    inode_mark_dirty(i_node_id);
+  }
+  pthread_mutex_lock(&g_load_lock);
+  slot_map_release(&g_inode_vacant_slots, i_node_id);
+  pthread_mutex_unlock(&g_load_lock);
+}
+#pragma endregion
+
+#pragma region FDT Utils
+/**
+ * @brief
+ * Close every entry of the FDT.
+ */
+void fdt_init() {
+  for (int i = 0; i < NUM_OF_FILES; i++) {
+    g_fdt[i].i_node_idx = -1;
+    g_fdt[i].read_write_pointer = -1;
+    g_fdt[i].last_block_idx = -1;
+    g_fdt[i].map_first_idx = -1;
+    g_fdt[i].map = NULL;
+    g_fdt[i].readahead_window = 0;
+    g_fdt[i].tail_block_idx = -1;
+    g_fdt[i].tail = NULL;
+    g_fdt[i].delayed = NULL;
+    g_fdt[i].delayed_size = g_fdt[i].delayed_capacity = g_fdt[i].delayed_reserved = 0;
+  }
+  slot_map_init(&g_fdt_vacant_slots, NUM_OF_FILES);
+  for (int i = 0; i < NUM_OF_FILES; i++) slot_map_release(&g_fdt_vacant_slots, i);
+  for (int i = 0; i < NUM_OF_I_NODES; i++) g_inode_fd[i] = -1;
+}
+
+/**
+ * @brief
+ * Check whether a file descriptor refers to an open file.
+ * @param fd The file descriptor.
+ * @return True, if open.
+ * @return False, otherwise.
+ */
+bool fdt_is_open(int fd) { return fd >= 0 && fd < NUM_OF_FILES && g_fdt[fd].i_node_idx != -1; }
+
+/**
+ * @brief
+ * Lock an open FDT entry for the duration of a call.
+ * The entry cannot be closed while it is locked.
+ * @param fd The file descriptor.
+ * @return True, if the entry is open, and now locked.
+ * @return False, otherwise.
+ */
+bool fdt_lock_entry(int fd) {
+  pthread_rwlock_rdlock(&g_dir_lock);
+  bool is_open = fdt_is_open(fd);
+  if (is_open) pthread_mutex_lock(&g_fdt[fd].lock);
+  pthread_rwlock_unlock(&g_dir_lock);
+  return is_open;
+}
+
+/**
+ * @brief
+ * Unlock an FDT entry locked by fdt_lock_entry().
+ * @param fd The file descriptor.
+ */
+void fdt_unlock_entry(int fd) { pthread_mutex_unlock(&g_fdt[fd].lock); }
+
+/**
+ * @brief
+ * Find the first vacant entry in the FDT.
+ * @return The ID of the available entry.
+ */
+int fdt_get_first_available_entry() { return slot_map_first(&g_fdt_vacant_slots); }
+
+/**
+ * @brief
+ * Open an i-Node through an FDT entry.
+ * @param fd The vacant FDT entry.
+ * @param i_node_idx The i-Node to open.
+ * @param read_write_pointer The initial read/write pointer.
+ */
+void fdt_open_entry(int fd, int i_node_idx, int read_write_pointer) {
+  g_fdt[fd].i_node_idx = i_node_idx;
+  g_fdt[fd].read_write_pointer = read_write_pointer;
+  g_inode_fd[i_node_idx] = fd;
+  slot_map_take(&g_fdt_vacant_slots, fd);
+
+  // Reading from the start of the file counts as sequential.
+  g_fdt[fd].last_read_end = 0;
+  g_fdt[fd].readahead_window = 0;
+  g_fdt[fd].readahead_end_idx = 0;
+  g_fdt[fd].tail_block_idx = -1;
+  g_fdt[fd].delayed_size = 0;
+}
+
+/**
+ * @brief
+ * Release an FDT entry. A partially written
+ * block still held by the entry is discarded,
+ * so flush it first if it still matters.
+ * @param fd The open FDT entry.
+ */
+void fdt_close_entry(int fd) {
+  g_inode_fd[g_fdt[fd].i_node_idx] = -1;
+  slot_map_release(&g_fdt_vacant_slots, fd);
+  g_fdt[fd].i_node_idx = -1;
+  g_fdt[fd].read_write_pointer = -1;
+  g_fdt[fd].last_block_idx = -1;
+  g_fdt[fd].map_first_idx = -1;
+  free(g_fdt[fd].map);
+  g_fdt[fd].map = NULL;
+  g_fdt[fd].readahead_window = 0;
+  g_fdt[fd].tail_block_idx = -1;
+  free(g_fdt[fd].tail);
+  g_fdt[fd].tail = NULL;
+  free(g_fdt[fd].delayed);
+  g_fdt[fd].delayed = NULL;
+  g_fdt[fd].delayed_size = g_fdt[fd].delayed_capacity = 0;
+  bitmap_reserve_blocks(-g_fdt[fd].delayed_reserved);
+  g_fdt[fd].delayed_reserved = 0;
+}
+
+/**
+ * @brief
+ * Drop the translations cached for an i-Node,
+ * after the blocks it maps have changed.
+ * @param i_node_idx The i-Node.
+ */
+void fdt_invalidate_block_map(int i_node_idx) {
+  int fd = g_inode_fd[i_node_idx];
+  if (fd == -1) return;
+  g_fdt[fd].last_block_idx = -1;
+  g_fdt[fd].map_first_idx = -1;
+}
+
+/**
+ * @brief
+ * Get the block ID of the specified page offset
+ * of an open file. The last translation and the
+ * pointer block it went through are kept in the
+ * FDT entry, so that sequential I/O reads each
+ * pointer block once rather than once per block.
+ * @param fd The file descriptor.
+ * @param loc The page offset, the offset starts from 0.
+ * @returns The block ID which should contain the offset.
+ * @returns -1, if cannot find the block ID.
+ */
+int fdt_get_block_id_by_offset(int fd, int loc) {
+  fdt_entry *entry = &g_fdt[fd];
+  i_node *node = inode_get(entry->i_node_idx);
+  int block_idx = loc / FILE_SYSTEM_BLOCK_SIZE;
+  if (block_idx == entry->last_block_idx) return entry->last_block_id;
+
+  if ((calculate_block_length(node->size) * FILE_SYSTEM_BLOCK_SIZE) <= loc) {
+    print_error("Trying to access memory that does not belong to the file.");
+    return -1;
+  }
+  if (block_idx < 12) return node->direct_pointers[block_idx];
+
+  // Past the direct pointers, every pointer block maps an
+  // aligned range of blocks, starting right after them.
+  int map_first_idx = 12 + (block_idx - 12) / INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE;
+  if (map_first_idx != entry->map_first_idx) {
+    int leaf_block_id = inode_get_leaf_block_id(node, block_idx);
+    if (leaf_block_id == -1) return -1;
+    if (entry->map == NULL) entry->map = (int *)malloc(FILE_SYSTEM_BLOCK_SIZE);
+    cache_read_blocks(leaf_block_id, 1, entry->map);
+    entry->map_first_idx = map_first_idx;
+  }
+  entry->last_block_idx = block_idx;
+  entry->last_block_id = entry->map[block_idx - map_first_idx];
+  return entry->last_block_id;
+}
+
+/**
+ * @brief
+ * Determine if the file has already
+ * been opened. If it has, then simple
+ * return its file descriptor, otherwise
+ * return -1.
+ * @param filename The filename.
+ * @return fd, if opened.
+ * @return -1, otherwise.
+ */
+int fdt_get_fd_by_filename(const char *filename) {
+  directory_entry *entry = root_get_directory_entry(filename);
+  return entry == NULL ? -1 : g_inode_fd[entry->i_node_id];
+}
+
+/**
+ * @brief
+ * Write the partially written block held
+ * by an FDT entry through the cache.
+ * @param fd The file descriptor.
+ */
+void fdt_flush_tail(int fd) {
+  fdt_entry *entry = &g_fdt[fd];
+  if (entry->tail_block_idx == -1) return;
+  cache_write_blocks(entry->tail_block_id, 1, entry->tail);
+  entry->tail_block_idx = -1;
+}
+
+/**
+ * @brief
+ * Get the size of a file, counting the data
+ * appended to it that has no blocks yet.
+ * @param i_node_idx The i-Node of the file.
+ * @return The size of the file.
+ */
+int fdt_get_file_size(int i_node_idx) {
+  int size = inode_get(i_node_idx)->size, fd = g_inode_fd[i_node_idx];
+  if (fd == -1 || g_fdt[fd].delayed_size == 0) return size;
+  return calculate_block_length(size) * FILE_SYSTEM_BLOCK_SIZE + g_fdt[fd].delayed_size;
+}
+
+/**
+ * @brief
+ * Hold data appended past the last block of
+ * a file in its FD, reserving the blocks it
+ * will need but choosing none of them yet.
+ * @param fd The file descriptor.
+ * @param src The bytes to write.
+ * @param length The number of bytes to write.
+ * @param offset The offset of the bytes past the last block of the file.
+ * @return 0, if success.
+ * @return -1, if the blocks cannot be reserved.
+ */
+int fdt_write_delayed(int fd, const char *src, int length, int offset) {
+  fdt_entry *entry = &g_fdt[fd];
+  int first_block_idx = calculate_block_length(inode_get(entry->i_node_idx)->size);
+  int size = max(entry->delayed_size, offset + length), num_of_blocks = calculate_block_length(size);
+  if (first_block_idx + (long long)num_of_blocks > inode_max_num_of_blocks()) {
+    print_error("The file has consumed all available iNode space.");
+    return -1;
+  }
+
+  // The pointer blocks mapping the data are reserved as well.
+  int num_of_needed_blocks =
+      num_of_blocks + (int)(inode_num_of_map_blocks(first_block_idx + (long long)num_of_blocks) -
+                            inode_num_of_map_blocks(first_block_idx));
+  if (num_of_needed_blocks > entry->delayed_reserved) {
+    if (!bitmap_reserve_blocks(num_of_needed_blocks - entry->delayed_reserved)) return -1;
+    entry->delayed_reserved = num_of_needed_blocks;
+  }
+
+  if (num_of_blocks * FILE_SYSTEM_BLOCK_SIZE > entry->delayed_capacity) {
+    entry->delayed_capacity = num_of_blocks * FILE_SYSTEM_BLOCK_SIZE;
+    entry->delayed = (char *)realloc(entry->delayed, entry->delayed_capacity);
+  }
+  if (offset > entry->delayed_size) memset(entry->delayed + entry->delayed_size, 0, offset - entry->delayed_size);
+  memcpy(entry->delayed + offset, src, length);
+  entry->delayed_size = size;
+  return 0;
+}
+
+/**
+ * @brief
+ * Choose the blocks of the data an FD holds past
+ * the last block of its file, all at once and
+ * from as few contiguous runs as possible, and
+ * write it through the cache.
+ * @param fd The file descriptor.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int fdt_flush_delayed(int fd) {
+  fdt_entry *entry = &g_fdt[fd];
+  if (entry->delayed_size == 0) return 0;
+
+  i_node *node = inode_get(entry->i_node_idx);
+  int first_block_idx = calculate_block_length(node->size);
+  int num_of_blocks = calculate_block_length(entry->delayed_size);
+  int *block_ids = (int *)malloc(num_of_blocks * sizeof(int));
+  if (inode_assign_new_blocks(node, first_block_idx, num_of_blocks, block_ids, entry->delayed_reserved) == -1) {
+    print_error("Cannot allocate more blocks.");
+    free(block_ids);
+    return -1;
+  }
+  entry->delayed_reserved = 0;
+
+  // Blocks adjacent on the disk are written together.
+  int padding = num_of_blocks * FILE_SYSTEM_BLOCK_SIZE - entry->delayed_size;
+  memset(entry->delayed + entry->delayed_size, 0, padding);
+  for (int i = 0, run; i < num_of_blocks; i += run) {
+    for (run = 1; i + run < num_of_blocks && block_ids[i + run] == block_ids[i] + run; run++)
+      ;
+    cache_write_blocks(block_ids[i], run, entry->delayed + i * FILE_SYSTEM_BLOCK_SIZE);
+  }
+  free(block_ids);
+
+  node->size = first_block_idx * FILE_SYSTEM_BLOCK_SIZE + entry->delayed_size;
+  entry->delayed_size = 0;
+  fdt_invalidate_block_map(entry->i_node_idx);
+  inode_mark_dirty(entry->i_node_idx);
+  return 0;
+}
+
+/**
+ * @brief
+ * Write the partially written blocks and the
+ * delayed data held by every open file
+ * through the cache.
+ */
+void fdt_flush_all_tails() {
+  for (int i = 0; g_fdt != NULL && i < NUM_OF_FILES; i++) {
+    if (g_fdt[i].i_node_idx == -1) continue;
+    fdt_flush_delayed(i);
+    fdt_flush_tail(i);
+  }
+}
+
+/**
+ * @brief
+ * Write part of a block into the tail of an FDT entry.
+ * Consecutive small writes to the same block are
+ * gathered there, and the block is read once and
+ * written once, when another block is written
+ * partially or when the tail is flushed.
+ * @param fd The file descriptor.
+ * @param block_idx The block of the file.
+ * @param block_id The block ID of that block.
+ * @param is_new Whether the block was just assigned, and holds nothing worth reading back.
+ * @param offset The offset within the block.
+ * @param src The bytes to write.
+ * @param size The number of bytes to write.
+ */
+void fdt_write_tail(int fd, int block_idx, int block_id, bool is_new, int offset, const char *src, int size) {
+  fdt_entry *entry = &g_fdt[fd];
+  if (entry->tail_block_idx != block_idx) {
+    fdt_flush_tail(fd);
+    if (entry->tail == NULL) entry->tail = (char *)malloc(FILE_SYSTEM_BLOCK_SIZE);
+    if (is_new)
+      memset(entry->tail, 0, FILE_SYSTEM_BLOCK_SIZE);
+    else
+      cache_read_blocks(block_id, 1, entry->tail);
+    entry->tail_block_idx = block_idx;
+    entry->tail_block_id = block_id;
+  }
+  memcpy(entry->tail + offset, src, size);
+}
+
+/**
+ * @brief
+ * Adapt the readahead window of a file to a read
+ * starting at the specified offset: a read picking up
+ * where the last one stopped opens the window, any
+ * other read closes it.
+ * @param fd The file descriptor.
+ * @param loc The offset the read starts at.
+ */
+void fdt_track_read(int fd, int loc) {
+  fdt_entry *entry = &g_fdt[fd];
+  if (loc != entry->last_read_end) {
+    entry->readahead_window = 0;
+    entry->readahead_end_idx = 0;
+  } else if (entry->readahead_window == 0)
+    entry->readahead_window = READAHEAD_MIN_WINDOW;
+}
+
+/**
+ * @brief
+ * Read ahead the next window of blocks of a file,
+ * starting from the specified block or from where
+ * the last readahead stopped, whichever comes last.
+ * Blocks adjacent on the disk are fetched together.
+ * The window doubles each time, up to its maximum.
+ * @param fd The file descriptor.
+ * @param block_idx The block of the file being read.
+ */
+void fdt_readahead(int fd, int block_idx) {
+  fdt_entry *entry = &g_fdt[fd];
+  int first = max(entry->readahead_end_idx, block_idx);
+  int end = min(calculate_block_length(inode_get(entry->i_node_idx)->size), first + entry->readahead_window);
+
+  int run_start = -1, run_length = 0;
+  for (int i = first; i < end; i++) {
+    int block_id = fdt_get_block_id_by_offset(fd, i * FILE_SYSTEM_BLOCK_SIZE);
+    if (run_length > 0 && block_id == run_start + run_length) {
+      run_length++;
+      continue;
+    }
+    if (run_length > 0) cache_prefetch_blocks(run_start, run_length);
+    run_start = block_id;
+    run_length = 1;
+  }
+  if (run_length > 0) cache_prefetch_blocks(run_start, run_length);
+
+  entry->readahead_end_idx = max(entry->readahead_end_idx, end);
+  entry->readahead_window = min(entry->readahead_window * 2, READAHEAD_MAX_WINDOW);
+}
+
+/**
+ * @brief
+ * Move the inline data of a file to a data
+ * block of its own. The block stays in the tail
+ * of the FD until it is flushed, so the move
+ * costs no I/O by itself.
+ * @param fd The file descriptor.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int fdt_move_inline_data(int fd) {
+  i_node *node = inode_get(g_fdt[fd].i_node_idx);
+  char data[I_NODE_SIZE];
+  memcpy(data, inode_inline_data(node), I_NODE_INLINE_DATA_SIZE);
+
+  node->flags &= ~I_NODE_INLINE_DATA;
+  for (int i = 0; i < 12; ++i) node->direct_pointers[i] = -1;
+  node->indirect_pointer = -1;
+  node->double_indirect_pointer = -1;
+  node->triple_indirect_pointer = -1;
+  int block_id;
+  if (node->size > 0 && inode_assign_new_blocks(node, 0, 1, &block_id, 0) == -1) {
+    node->flags |= I_NODE_INLINE_DATA;
+    memcpy(inode_inline_data(node), data, I_NODE_INLINE_DATA_SIZE);
+    return -1;
+  }
+  if (node->size > 0) fdt_write_tail(fd, 0, block_id, true, 0, data, node->size);
+  inode_mark_dirty(g_fdt[fd].i_node_idx);
+  return 0;
+}
+
+/**
+ * @brief
+ * Write to a file at an offset, leaving its
+ * read/write pointer alone. Call it with the
+ * entry locked and its i-Node write locked.
+ * @param fd The file descriptor.
+ * @param buf The buffer to write.
+ * @param length The length of the message.
+ * @param loc The offset to write at.
+ * @return number of bytes written, if successful.
+ * @return -1, otherwise.
+ */
+int fdt_write_at(int fd, const char *buf, int length, int loc) {
+  // The end of the write must fit in the size of a file.
+  if (loc < 0 || length < 0 || length > INT32_MAX - loc) {
+    print_error("Cannot write past the largest file size.");
+    return -1;
+  }
+  i_node *node = inode_get(g_fdt[fd].i_node_idx);
+
+  // A small file is written in its i-Node, until it outgrows it.
+  if (node->flags & I_NODE_INLINE_DATA) {
+    if (loc + length <= I_NODE_INLINE_DATA_SIZE) {
+      memcpy(inode_inline_data(node) + loc, buf, length);
+      node->size = max(node->size, loc + length);
+      inode_mark_dirty(g_fdt[fd].i_node_idx);
+      commit_operation();
+      return length;
+    }
+    if (fdt_move_inline_data(fd) == -1) {
+      print_error("Cannot allocate more blocks.");
+      return -1;
+    }
+  }
+
+  // Writing back, data appended past the last block of the file waits in
+  // the FD. Its blocks are chosen together when it is flushed, or once
+  // there is too much of it.
+  int delayed_bytes = 0;
+  if (g_durability == SFS_WRITE_BACK) {
+    int delayed_start = calculate_block_length(node->size) * FILE_SYSTEM_BLOCK_SIZE, end = loc + length;
+    if (end > delayed_start &&
+        calculate_block_length(max(g_fdt[fd].delayed_size, end - delayed_start)) > DELAYED_MAX_BLOCKS) {
+      if (fdt_flush_delayed(fd) == -1) return -1;
+      delayed_start = calculate_block_length(node->size) * FILE_SYSTEM_BLOCK_SIZE;
+    }
+    if (end > delayed_start && calculate_block_length(end - delayed_start) <= DELAYED_MAX_BLOCKS) {
+      int offset = max(loc, delayed_start);
+      if (fdt_write_delayed(fd, buf + (offset - loc), end - offset, offset - delayed_start) == -1) return -1;
+      delayed_bytes = end - offset;
+      length -= delayed_bytes;
+      if (length == 0) return delayed_bytes;
+    }
+  }
+
+  const char *buf_cpy = buf;
+  int file_size = node->size, ptr = loc, total_bytes_written = 0;
+
+  // Reserve every block the write needs past the end of the file up front,
+  // so that they come from as few contiguous runs as possible.
+  int num_of_allocated_blocks = calculate_block_length(file_size);
+  int num_of_new_blocks = max(0, calculate_block_length(ptr + length) - num_of_allocated_blocks);
+  int *new_block_ids = NULL;
+  if (num_of_new_blocks > 0) {
+    new_block_ids = (int *)malloc(num_of_new_blocks * sizeof(int));
+    if (inode_assign_new_blocks(node, num_of_allocated_blocks, num_of_new_blocks, new_block_ids, 0) == -1) {
+      print_error("Cannot allocate more blocks.");
+      free(new_block_ids);
+      return -1;
+    }
+    fdt_invalidate_block_map(g_fdt[fd].i_node_idx);
+
+    // The blocks a write past the end of the file skips read back as
+    // zeros, not as whatever their previous owner left in them. The
+    // block the write starts in is zero-filled in the tail if partial.
+    int num_of_hole_blocks = min(num_of_new_blocks, ptr / FILE_SYSTEM_BLOCK_SIZE - num_of_allocated_blocks);
+    if (num_of_hole_blocks > 0) cache_zero_blocks(new_block_ids, num_of_hole_blocks);
+  }
+  block_request runs[MAX_QUEUED_RUNS];
+  int num_of_runs = 0;
+  while (length > 0) {
+    int block_idx = ptr / FILE_SYSTEM_BLOCK_SIZE, block_offset = ptr % FILE_SYSTEM_BLOCK_SIZE;
+    int bytes_to_write = min(FILE_SYSTEM_BLOCK_SIZE - block_offset, length);
+
+    if (bytes_to_write < FILE_SYSTEM_BLOCK_SIZE) {
+      // Partial blocks are gathered in the tail of the FD.
+      bool is_new = block_idx >= num_of_allocated_blocks;
+      int block_id =
+          is_new ? new_block_ids[block_idx - num_of_allocated_blocks] : fdt_get_block_id_by_offset(fd, ptr);
+      fdt_write_tail(fd, block_idx, block_id, is_new, block_offset, buf_cpy, bytes_to_write);
+    } else {
+      // Whole blocks that are also adjacent on the disk are written
+      // straight from the caller's buffer at once. The old contents
+      // of an overwritten block are never read back.
+      int num_of_whole_blocks = length / FILE_SYSTEM_BLOCK_SIZE, run = 1;
+      int block_id = block_idx >= num_of_allocated_blocks ? new_block_ids[block_idx - num_of_allocated_blocks]
+                                                          : fdt_get_block_id_by_offset(fd, ptr);
+      if (block_idx >= num_of_allocated_blocks) {
+        int *ids = &new_block_ids[block_idx - num_of_allocated_blocks];
+        while (run < num_of_whole_blocks && ids[run] == ids[0] + run) run++;
+      } else {
+        while (run < num_of_whole_blocks && block_idx + run < num_of_allocated_blocks &&
+               fdt_get_block_id_by_offset(fd, ptr + run * FILE_SYSTEM_BLOCK_SIZE) == block_id + run)
+          run++;
+      }
+
+      // A tail in the range is superseded.
+      int tail_block_idx = g_fdt[fd].tail_block_idx;
+      if (tail_block_idx >= block_idx && tail_block_idx < block_idx + run) g_fdt[fd].tail_block_idx = -1;
+
+      // When writing through, long runs are queued and written
+      // together with the metadata at the commit.
+      bytes_to_write = run * FILE_SYSTEM_BLOCK_SIZE;
+      if (run > CACHE_WRITE_AROUND_THRESHOLD && num_of_runs < MAX_QUEUED_RUNS && g_durability == SFS_WRITE_THROUGH)
+        runs[num_of_runs++] = (block_request){1, block_id, run, (void *)buf_cpy, 0, 0};
+      else
+        cache_write_blocks(block_id, run, buf_cpy);
+    }
+
+    buf_cpy += bytes_to_write;
+    ptr += bytes_to_write;
+    length -= bytes_to_write;
+    total_bytes_written += bytes_to_write;
+    file_size = max(file_size, ptr);
+  }
+  free(new_block_ids);
+
+  // Writing through, the tail has to be durable too.
+  if (g_durability == SFS_WRITE_THROUGH) fdt_flush_tail(fd);
+  node->size = file_size;
+  inode_mark_dirty(g_fdt[fd].i_node_idx);
+  commit_operation_with(runs, num_of_runs);
+  return total_bytes_written + delayed_bytes;
+}
+
+/**
+ * @brief
+ * Read from a file at an offset, leaving its
+ * read/write pointer alone. Call it with the
+ * i-Node read locked. The call holding the
+ * entry translates blocks through it and keeps
+ * its readahead going. Other readers translate
+ * through the i-Node. A pending tail is read
+ * where it is.
+ * @param fd The file descriptor.
+ * @param buf The buffer to which the message is written.
+ * @param length The length of the message to read.
+ * @param loc The offset to read at.
+ * @param owns_entry Whether the entry is locked by the caller.
+ * @return The number of bytes read.
+ */
+int fdt_read_at(int fd, char *buf, int length, int loc, bool owns_entry) {
+  fdt_entry *entry = &g_fdt[fd];
+  i_node *node = inode_get(entry->i_node_idx);
+  char *buf_cpy = buf;
+  int ptr = loc, total_bytes_read = 0, file_size = fdt_get_file_size(entry->i_node_idx);
+
+  // Inline data is served from the i-Node table.
+  if (node->flags & I_NODE_INLINE_DATA) {
+    total_bytes_read = max(0, min(length, file_size - ptr));
+    memcpy(buf, inode_inline_data(node) + ptr, total_bytes_read);
+    return total_bytes_read;
+  }
+
+  if (owns_entry) fdt_track_read(fd, ptr);
+  while (length > 0 && ptr < file_size) {
+    // Keep the readahead half a window in front of the reader.
+    int block_idx = ptr / FILE_SYSTEM_BLOCK_SIZE;
+    if (owns_entry && entry->readahead_window > 0 &&
+        block_idx >= entry->readahead_end_idx - entry->readahead_window / 2)
+      fdt_readahead(fd, block_idx);
+
+    int bytes_to_read = min(FILE_SYSTEM_BLOCK_SIZE - ptr % FILE_SYSTEM_BLOCK_SIZE,
+                            length >= FILE_SYSTEM_BLOCK_SIZE ? FILE_SYSTEM_BLOCK_SIZE : length);
+
+    // Calibrate the bytes_to_read with respect to file size.
+    bytes_to_read = min(bytes_to_read, file_size - ptr);
+
+    int delayed_start = calculate_block_length(node->size) * FILE_SYSTEM_BLOCK_SIZE;
+    if (entry->delayed_size > 0 && ptr >= delayed_start) {
+      memcpy(buf_cpy, entry->delayed + ptr - delayed_start, bytes_to_read);
+    } else if (block_idx == entry->tail_block_idx) {
+      memcpy(buf_cpy, entry->tail + ptr % FILE_SYSTEM_BLOCK_SIZE, bytes_to_read);
+    } else {
+      int block_id = owns_entry ? fdt_get_block_id_by_offset(fd, ptr) : inode_get_block_id(node, block_idx);
+      char block_data[FILE_SYSTEM_BLOCK_SIZE];
+      cache_read_blocks(block_id, 1, block_data);
+      memcpy(buf_cpy, block_data + ptr % FILE_SYSTEM_BLOCK_SIZE, bytes_to_read);
+    }
+    buf_cpy += bytes_to_read;
+    ptr += bytes_to_read;
+    length -= bytes_to_read;
+    total_bytes_read += bytes_to_read;
+  }
+
+  if (owns_entry) entry->last_read_end = ptr;
+  return total_bytes_read;
+}
+#pragma endregion
+
+#pragma region Geometry Utils
+/**
+ * @brief
+ * Lay out a volume of the specified geometry.
+ * The super block is followed by the i-Node table,
+ * the root directory and the data blocks, while
+ * the journal and the g_bitmap take the last
+ * blocks of the disk.
+ * @param options The geometry of the volume.
+ * @return super_block The super block describing the layout.
+ */
+super_block super_block_layout(const sfs_options *options) {
+  int block_size = options->block_size;
+  super_block sb = {.magic_number = MAGIC_NUMBER,
+                    .block_size = block_size,
+                    .file_system_size = options->num_blocks,
+                    .i_node_num = options->num_i_nodes,
+                    .i_node_table_start = 1,
+                    .journal_length = options->journal_length};
+  sb.i_node_table_length = (int)(((long long)sb.i_node_num * sizeof(i_node) + block_size - 1) / block_size);
+  sb.root_directory = sb.i_node_table_start + sb.i_node_table_length;
+  sb.root_directory_length =
+      (int)(((long long)(sb.i_node_num - 1) * sizeof(directory_entry) + block_size - 1) / block_size);
+  sb.data_block_start = sb.root_directory + sb.root_directory_length;
+  sb.bitmap_length = (int)((((long long)sb.file_system_size + 7) / 8 + block_size - 1) / block_size);
+  sb.bitmap_start = sb.file_system_size - sb.bitmap_length;
+  sb.journal_start = sb.bitmap_start - sb.journal_length;
+  return sb;
+}
+
+/**
+ * @brief
+ * Check that a super block describes a volume
+ * this implementation can mount.
+ * @param sb The super block.
+ * @returns true, if the layout is consistent.
+ * @returns false, if not.
+ */
+bool super_block_is_valid(const super_block *sb) {
+  long long block_size = sb->block_size;
+  if (sb->magic_number != MAGIC_NUMBER) return false;
+  if (block_size < MIN_FILE_SYSTEM_BLOCK_SIZE || block_size > MAX_FILE_SYSTEM_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0)
+    return false;
+  if (sb->i_node_num < 2 || sb->file_system_size < 1) return false;
+
+  // Every region has to be large enough for its table.
+  if (sb->i_node_table_length * block_size < (long long)sb->i_node_num * (long long)sizeof(i_node)) return false;
+  if (sb->root_directory_length * block_size < (long long)(sb->i_node_num - 1) * (long long)sizeof(directory_entry))
+    return false;
+  if (sb->bitmap_length * block_size < ((long long)sb->file_system_size + 7) / 8) return false;
+
+  // The journal, if any, sits between the data blocks and the g_bitmap.
+  if (sb->journal_length != 0 &&
+      (sb->journal_length < MIN_JOURNAL_LENGTH || sb->journal_start <= sb->data_block_start ||
+       sb->journal_start + (long long)sb->journal_length > sb->bitmap_start))
+    return false;
+
+  // The regions have to be in order, non-overlapping and on the disk,
+  // with room left for at least one data block.
+  return sb->i_node_table_start >= 1 && sb->root_directory >= sb->i_node_table_start + sb->i_node_table_length &&
+         sb->data_block_start >= sb->root_directory + sb->root_directory_length &&
+         sb->bitmap_start > sb->data_block_start && sb->bitmap_start + sb->bitmap_length <= sb->file_system_size;
+}
+
+/**
+ * @brief
+ * Adopt the geometry and the layout of a super block,
+ * sizing the cached tables and the block cache after it.
+ * The tables are zeroed.
+ * @param sb The super block.
+ */
+void geometry_apply(const super_block *sb) {
+  // The FDT entries own their cached pointer blocks and tails.
+  for (int i = 0; g_fdt != NULL && i < NUM_OF_FILES; i++) {
+    free(g_fdt[i].map);
+    free(g_fdt[i].tail);
+    pthread_mutex_destroy(&g_fdt[i].lock);
+  }
+  for (int i = 0; g_inode_locks != NULL && i < NUM_OF_I_NODES; i++) pthread_rwlock_destroy(&g_inode_locks[i]);
+  free(g_inode_locks);
+
+  FILE_SYSTEM_BLOCK_SIZE = sb->block_size;
+  FILE_SYSTEM_SIZE = sb->file_system_size;
+  NUM_OF_I_NODES = sb->i_node_num;
+
+  I_NODE_TABLE_START = sb->i_node_table_start;
+  I_NODE_TABLE_LENGTH = sb->i_node_table_length;
+  ROOT_DIRECTORY_START = sb->root_directory;
+  ROOT_DIRECTORY_LENGTH = sb->root_directory_length;
+  DATA_BLOCK_START = sb->data_block_start;
+  BITMAP_START = sb->bitmap_start;
+  BITMAP_LENGTH = sb->bitmap_length;
+  JOURNAL_LENGTH = sb->journal_length;
+  JOURNAL_START = JOURNAL_LENGTH > 0 ? sb->journal_start : BITMAP_START;
+  DATA_BLOCK_LENGTH = JOURNAL_START - DATA_BLOCK_START;
+
+  // Start over with an empty transaction.
+  free(g_journal_freed_blocks);
+  g_journal_freed_blocks = NULL;
+  g_journal_num_of_freed_blocks = g_journal_freed_blocks_capacity = 0;
+  g_journal_num_of_ops = 0;
+  g_journal_sequence = 1;
+  g_bitmap_num_of_reserved_blocks = 0;
+
+  free(g_inode_table);
+  free(g_inode_blocks_loaded);
+  free(g_fdt);
+  free(g_root_directory_table);
+  free(g_bitmap);
+  free(g_root_hash_heads);
+  free(g_root_hash_next);
+  free(g_inode_fd);
+  g_inode_table = (i_node *)calloc(NUM_OF_I_NODES, sizeof(i_node));
+  g_inode_blocks_loaded = (bool *)calloc(I_NODE_TABLE_LENGTH, sizeof(bool));
+  slot_map_init(&g_inode_vacant_slots, NUM_OF_I_NODES);
+  g_inode_load_cursor = 0;
+  g_fdt = (fdt_entry *)calloc(NUM_OF_FILES, sizeof(fdt_entry));
+  g_root_directory_table = (directory_entry *)calloc(NUM_OF_FILES, sizeof(directory_entry));
+  g_bitmap = (unsigned char *)calloc(BITMAP_SIZE, 1);
+
+  // Keep the hash chains short: at least one bucket per file.
+  for (g_root_hash_size = 1; g_root_hash_size < NUM_OF_FILES; g_root_hash_size *= 2)
+    ;
+  g_root_hash_heads = (int *)calloc(g_root_hash_size, sizeof(int));
+  g_root_hash_next = (int *)calloc(NUM_OF_FILES, sizeof(int));
+  g_inode_fd = (int *)calloc(NUM_OF_I_NODES, sizeof(int));
+
+  for (int i = 0; i < NUM_OF_FILES; i++) pthread_mutex_init(&g_fdt[i].lock, NULL);
+  g_inode_locks = (pthread_rwlock_t *)malloc(NUM_OF_I_NODES * sizeof(pthread_rwlock_t));
+  for (int i = 0; i < NUM_OF_I_NODES; i++) pthread_rwlock_init(&g_inode_locks[i], NULL);
+
+  cache_init();
+}
+
+/**
+ * @brief
+ * Read the super block of an existing disk. Its
+ * block size is not known yet, so the first
+ * MIN_FILE_SYSTEM_BLOCK_SIZE bytes are probed.
+ * @param filename The disk file.
+ * @param sb The super block read.
+ * @returns 0, if a valid super block was read.
+ * @returns -1, if not.
+ */
+int super_block_read(char *filename, super_block *sb) {
+  char probe[MIN_FILE_SYSTEM_BLOCK_SIZE];
+  if (init_disk(filename, MIN_FILE_SYSTEM_BLOCK_SIZE, 1) == -1) return -1;
+  int result = read_blocks(0, 1, probe);
+  close_disk();
+  if (result == -1) return -1;
+  memcpy(sb, probe, sizeof(super_block));
+  return super_block_is_valid(sb) ? 0 : -1;
+}
+#pragma endregion
+
+#pragma region APIs
+/**
+ * @brief
+ * Fill in the default volume geometry:
+ * 1024 blocks of 1 KiB, 200 i-Nodes and
+ * a journal of 32 blocks, written through.
+ * @param options The options to fill in.
+ */
+void sfs_default_options(sfs_options *options) {
+  options->block_size = DEFAULT_FILE_SYSTEM_BLOCK_SIZE;
+  options->num_blocks = DEFAULT_FILE_SYSTEM_SIZE;
+  options->num_i_nodes = DEFAULT_NUM_OF_I_NODES;
+  options->journal_length = DEFAULT_JOURNAL_LENGTH;
+  options->durability = SFS_WRITE_THROUGH;
+}
+
+/**
+ * @brief
+ * Initialize Simple File System.
+ * If the flag is 1, we create the file system from scratch,
+ * in accordance with the default settings.
+ *
+ * If the flag is 0, we read the super_block from the disk, and
+ * initialize the file system accordingly.
+ *
+ * @param flag Indicate whether to create the file system from scratch.
+ */
+void mksfs(int flag) {
+  sfs_options options;
+  sfs_default_options(&options);
+  mksfs_with_options(flag, &options);
+}
+
+/**
+ * @brief
+ * Initialize Simple File System.
+ * If the flag is 1, we create the file system from scratch,
+ * with the geometry in the options.
+ *
+ * If the flag is 0, the geometry and the layout come from
+ * the super_block on the disk, and only the durability is
+ * taken from the options.
+ *
+ * @param flag Indicate whether to create the file system from scratch.
+ * @param options The geometry of a fresh file system.
+ */
+void mksfs_with_options(int flag, const sfs_options *options) {
+  struct super_block super_block;
+  if (flag == 1) {
+    super_block = super_block_layout(options);
+    if (!super_block_is_valid(&super_block)) {
+      print_error("Cannot create a file system of the requested geometry.");
+      return;
+    }
+  }
+
+  // Write back whatever a previous mount left in the cache
+  // and the journal, then start over with empty ones.
+  fdt_flush_all_tails();
+  commit_operation_durably();
+  close_disk();
+  sfs_reset_stats();
+  if (!g_verbose_is_set) {
+    const char *verbose = getenv("SFS_VERBOSE");
+    g_verbose = verbose != NULL && strcmp(verbose, "") != 0 && strcmp(verbose, "0") != 0;
+  }
+  g_durability = options->durability == SFS_WRITE_BACK ? SFS_WRITE_BACK : SFS_WRITE_THROUGH;
+
+  if (flag == 1) {
+    // Initialize the Simple File System from scratch.
+    geometry_apply(&super_block);
+
+    // Init a fresh disk.
+    if (init_fresh_disk("sfs.txt", FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_SIZE) == -1) {
+      print_error("Cannot create the disk.");
+      return;
+    }
+
+    // Initialize the iNode table.
+    for (int i = 0; i < NUM_OF_I_NODES; i++) {
+      g_inode_table[i].mode = 0x777;
+      g_inode_table[i].link_count = 0;
+      g_inode_table[i].uid = -1;
+      g_inode_table[i].gid = -1;
+      g_inode_table[i].size = -1;
+      for (int j = 0; j < 12; ++j) g_inode_table[i].direct_pointers[j] = -1;
+      g_inode_table[i].indirect_pointer = -1;
+      g_inode_table[i].double_indirect_pointer = -1;
+      g_inode_table[i].triple_indirect_pointer = -1;
+    }
+    for (int i = 0; i < I_NODE_TABLE_LENGTH; i++) g_inode_blocks_loaded[i] = true;
+    inode_track_vacant_slots(0, I_NODE_TABLE_LENGTH);
+    g_inode_load_cursor = I_NODE_TABLE_LENGTH;
+
+    // Initialize root iNode. The root directory is always
+    // accessed through its region, so on larger geometries
+    // only its first 12 blocks are recorded here.
+    struct i_node *r = &g_inode_table[0];
+    r->size = NUM_OF_FILES * sizeof(directory_entry);
+    for (int i = 0; i < ROOT_DIRECTORY_LENGTH && i < 12; i++) r->direct_pointers[i] = i + ROOT_DIRECTORY_START;
+
+    // Initialize the root directory table.
+    for (int i = 0; i < NUM_OF_FILES; i++) {
+      g_root_directory_table[i].i_node_id = -1;
+      for (int j = 0; j < MAX_FILE_NAME_SIZE; j++)
+        g_root_directory_table[i].file_name[j] = '\0';
+    }
+    metadata_regions_init(true);
+
+    // Initialize the g_bitmap.
+    for (int i = 0; i < BITMAP_SIZE; ++i) g_bitmap[i] = 255;
+    for (int i = 0; i < DATA_BLOCK_START; i++) bitmap_occupy_a_block(i);
+    for (int i = JOURNAL_START; i < FILE_SYSTEM_SIZE; i++) bitmap_occupy_a_block(i);
+    bitmap_recount();
+
+    // The super block, the i-Node table and the root directory are adjacent,
+    // so lay them out in one buffer and save them with a single write. The
+    // data blocks of a fresh disk already read as 0's and are not written.
+    char *buffer = buffer_pool_get(DATA_BLOCK_START * FILE_SYSTEM_BLOCK_SIZE);
+    memset(buffer, 0, DATA_BLOCK_START * FILE_SYSTEM_BLOCK_SIZE);
+    memcpy(buffer, &super_block, sizeof(super_block));
+    memcpy(buffer + I_NODE_TABLE_START * FILE_SYSTEM_BLOCK_SIZE, g_inode_table, NUM_OF_I_NODES * sizeof(i_node));
+    memcpy(buffer + ROOT_DIRECTORY_START * FILE_SYSTEM_BLOCK_SIZE, g_root_directory_table,
+           NUM_OF_FILES * sizeof(directory_entry));
+    cache_write_blocks(0, DATA_BLOCK_START, buffer);
+    buffer_pool_put(buffer);
+
+    // Save the g_bitmap, the only region left. A fresh disk
+    // has nothing to protect, so it skips the journal.
+    region_mark_all_dirty(&g_bitmap_region);
+    flush_dirty_metadata();
+    cache_flush();
+
+    // Initialize the FDT, the lookup indices and the directory iterators.
+    fdt_init();
+    root_index_rebuild();
+    root_iterators_init();
+  } else {
+    // The Simple File System is already stored on disk,
+    // we should read from the disk to cache necessary
+    // contents, starting with the super block which
+    // tells the geometry and the layout.
+    if (super_block_read("sfs.txt", &super_block) == -1) {
+      print_error("Cannot find a valid super block on the disk.");
+      return;
+    }
+    geometry_apply(&super_block);
+
+    // Init an existing disk
+    if (init_disk("sfs.txt", FILE_SYSTEM_BLOCK_SIZE, FILE_SYSTEM_SIZE) == -1) {
+      print_error("Cannot open the disk.");
+      return;
+    }
+
+    // Finish the last transaction, if a crash interrupted it.
+    journal_replay();
+
+    // The iNode table is paged in on demand, see inode_get().
+    // Read root directory, which the name index needs whole.
+    char *buf = buffer_pool_get(ROOT_DIRECTORY_LENGTH * FILE_SYSTEM_BLOCK_SIZE);
+    cache_read_blocks(ROOT_DIRECTORY_START, ROOT_DIRECTORY_LENGTH, buf);
+    memcpy(g_root_directory_table, buf, sizeof(directory_entry) * NUM_OF_FILES);
+    buffer_pool_put(buf);
+
+    // Read the g_bitmap.
+    buf = buffer_pool_get(BITMAP_LENGTH * FILE_SYSTEM_BLOCK_SIZE);
+    cache_read_blocks(BITMAP_START, BITMAP_LENGTH, buf);
+    memcpy(g_bitmap, buf, BITMAP_SIZE);
+    buffer_pool_put(buf);
+    bitmap_recount();
+    metadata_regions_init(false);
+
+    // Initialize the FDT, the lookup indices and the directory iterators.
+    fdt_init();
+    root_index_rebuild();
+    root_iterators_init();
+  }
+}
+
+/**
+ * @brief
+ * Get the name of the next file.
+ *
+ * @param result_buffer The buffer to which the method writes the result.
+ * @return 1, if success.
+ * @return -1, otherwise.
+ */
+int sfs_getnextfilename(char *result_buffer) {
+  pthread_rwlock_wrlock(&g_dir_lock);
+  directory_entry *entry = root_get_next_file(&root_file_counter);
+  if (entry == NULL)
+    root_file_counter = 0;
+  else
+    strcpy(result_buffer, entry->file_name);
+  pthread_rwlock_unlock(&g_dir_lock);
+  return entry == NULL ? 0 : 1;
+}
+
+/**
+ * @brief
+ * Start iterating over the root directory.
+ * Unlike sfs_getnextfilename, any number of
+ * iterations may be in progress at once.
+ *
+ * @return The directory handle, if success.
+ * @return -1, if too many directories are open.
+ */
+int sfs_opendir() {
+  pthread_rwlock_wrlock(&g_dir_lock);
+  for (int i = 0; i < MAX_DIR_ITERATORS; i++)
+    if (g_dir_iterators[i] == -1) {
+      g_dir_iterators[i] = 0;
+      pthread_rwlock_unlock(&g_dir_lock);
+      return i;
+    }
+  pthread_rwlock_unlock(&g_dir_lock);
+  print_error("Cannot open the directory because too many iterations are in progress.");
+  return -1;
+}
+
+/**
+ * @brief
+ * Get the name of the next file of a directory iteration.
+ *
+ * @param dir The directory handle.
+ * @param result_buffer The buffer to which the method writes the result.
+ * @return 1, if a file is found.
+ * @return 0, if the iteration is over.
+ * @return -1, if the handle is invalid.
+ */
+int sfs_readdir(int dir, char *result_buffer) {
+  pthread_rwlock_wrlock(&g_dir_lock);
+  if (dir < 0 || dir >= MAX_DIR_ITERATORS || g_dir_iterators[dir] == -1) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    print_error("Cannot read a directory that is not opened.");
+    return -1;
+  }
+
+  directory_entry *entry = root_get_next_file(&g_dir_iterators[dir]);
+  if (entry != NULL) strcpy(result_buffer, entry->file_name);
+  pthread_rwlock_unlock(&g_dir_lock);
+  return entry == NULL ? 0 : 1;
+}
+
+/**
+ * @brief
+ * Finish a directory iteration.
+ *
+ * @param dir The directory handle.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int sfs_closedir(int dir) {
+  pthread_rwlock_wrlock(&g_dir_lock);
+  if (dir < 0 || dir >= MAX_DIR_ITERATORS || g_dir_iterators[dir] == -1) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    print_error("Attempt to close a directory that has already been closed.");
+    return -1;
+  }
+  g_dir_iterators[dir] = -1;
+  pthread_rwlock_unlock(&g_dir_lock);
+  return 0;
+}
+
+/**
+ * @brief
+ * Get the file size of the specified file.
+ *
+ * @param filename The filename.
+ * @return int, the file size if the file exists.
+ * @return -1, if failed.
+ */
+int sfs_getfilesize(const char *filename) {
+  int size = -1;
+  pthread_rwlock_rdlock(&g_dir_lock);
+  directory_entry *result = root_get_directory_entry(filename);
+  if (result != NULL) {
+    pthread_rwlock_rdlock(&g_inode_locks[result->i_node_id]);
+    size = fdt_get_file_size(result->i_node_id);
+    pthread_rwlock_unlock(&g_inode_locks[result->i_node_id]);
+  }
+  pthread_rwlock_unlock(&g_dir_lock);
+  return size;
+}
+
+/**
+ * @brief
+ * Create an empty file in the root directory,
+ * without opening it nor committing. Call it
+ * with g_dir_lock write locked.
+ * @param filename The name of the file, which does not exist yet.
+ * @return The index of its directory entry.
+ * @return -1, if the root or the iNode table is full.
+ */
+int create_file(const char *filename) {
+  int vac_root = root_get_first_available_directory_entry();
+  int vac_i_node = inode_tab_get_first_available_entry();
+  if (vac_root == -1 || vac_i_node == -1) return -1;
+
+  inode_init_inline(vac_i_node);
+  g_root_directory_table[vac_root].i_node_id = vac_i_node;
+  strcpy(g_root_directory_table[vac_root].file_name, filename);
+  root_index_insert(vac_root);
+  inode_mark_dirty(vac_i_node);
+  root_mark_dirty(&g_root_directory_table[vac_root]);
+  return vac_root;
+}
+
+/**
+ * @brief
+ * If the file exists, bring it into the FDT.
+ * If the file does not exist, create the file.
+ *
+ * @param filename The filename.
+ * @return 1, if success.
+ * @return 0, otherwise.
+ */
+int do_fopen(char *filename) {
+  // Test if the filename is too long.
+  // If it is. we should reject the request.
+  if (strlen(filename) >= MAX_FILE_NAME_SIZE) {
+    char msg[100];
+    sprintf(msg, "The filename is too long, with %lu bytes.", strlen(filename));
+    print_error(msg);
+    return -1;
+  }
+
+  // Search through the FDT.
   // If the file has already been opened,
   // simply return its file descriptor.
+  pthread_rwlock_wrlock(&g_dir_lock);
   int fd = fdt_get_fd_by_filename(filename);
-  if (fd != -1) return fd;
+  if (fd != -1) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    return fd;
+  }
 
   directory_entry *target = root_get_directory_entry(filename);
   if (target != NULL) {
@@ -679,40 +3311,49 @@ int sfs_fopen(char *filename) {
 
     // If the FDT is full.
     if (vac_fdt == -1) {
+      pthread_rwlock_unlock(&g_dir_lock);
       char msg[1000];
       sprintf(msg, "Cannot open file '%s' because the FDT is full.", filename);
       print_error(msg);
       return -1;
     }
 
-    g_fdt[vac_fdt].i_node_idx = (*target).i_node_id;
-    g_fdt[vac_fdt].read_write_pointer = g_inode_table[target->i_node_id].size;
+    fdt_open_entry(vac_fdt, target->i_node_id, inode_get(target->i_node_id)->size);
+    pthread_rwlock_unlock(&g_dir_lock);
     return vac_fdt;
   } else {
     // The file does not exist, and we shall create it.
-    int vac_root = root_get_first_available_directory_entry();
-    int vac_i_node = inode_tab_get_first_available_entry();
     int vac_fdt = fdt_get_first_available_entry();
+    int vac_root = vac_fdt == -1 ? -1 : create_file(filename);
 
     // If there is no available resources.
-    if (vac_root == -1 || vac_i_node == -1 || vac_fdt == -1) {
+    if (vac_root == -1) {
+      pthread_rwlock_unlock(&g_dir_lock);
       char msg[1000];
       sprintf(msg, "Cannot open file '%s' because either the root, the iNode table, or the fdt is full.", filename);
       print_error(msg);
       return -1;
     }
 
-    g_inode_table[vac_i_node].size = 0;
-    g_root_directory_table[vac_root].i_node_id = vac_i_node;
-    strcpy(g_root_directory_table[vac_root].file_name, filename);
-    g_fdt[vac_fdt].i_node_idx = vac_i_node;
-    g_fdt[vac_fdt].read_write_pointer = 0;
-    flush_i_node_table();
-    flush_root_directory_table();
+    fdt_open_entry(vac_fdt, g_root_directory_table[vac_root].i_node_id, 0);
+    pthread_rwlock_unlock(&g_dir_lock);
+    commit_operation();
     return vac_fdt;
   }
 }
 
+/**
+ * @brief
+ * Open or create a file, see do_fopen(),
+ * and time the call.
+ */
+int sfs_fopen(char *filename) {
+  long long start_ns = stats_clock_ns();
+  int fd = do_fopen(filename);
+  stats_record_latency(SFS_OP_FOPEN, start_ns);
+  return fd;
+}
+
 /**
  * @brief
  * Remove the file from the FDT.
@@ -722,13 +3363,28 @@ int sfs_fopen(char *filename) {
  * @return -1, otherwise.
  */
 int sfs_fclose(int fd) {
-  if (g_fdt[fd].i_node_idx == -1) {
+  pthread_rwlock_wrlock(&g_dir_lock);
+  if (!fdt_is_open(fd)) {
+    pthread_rwlock_unlock(&g_dir_lock);
     print_error("Attempt to close a file that has already been closed.");
     return -1;
   }
 
-  g_fdt[fd].i_node_idx = -1;
-  g_fdt[fd].read_write_pointer = -1;
+  // Wait for the calls still using the entry, and for the
+  // readers of the i-Node that may be looking at its tail.
+  pthread_mutex_lock(&g_fdt[fd].lock);
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_wrlock(inode_lock);
+  fdt_flush_delayed(fd);
+  fdt_flush_tail(fd);
+  fdt_close_entry(fd);
+  pthread_rwlock_unlock(inode_lock);
+  pthread_mutex_unlock(&g_fdt[fd].lock);
+
+  // The commit only needs the journal, so the
+  // other calls on the directory need not wait.
+  pthread_rwlock_unlock(&g_dir_lock);
+  commit_operation();
   return 0;
 }
 
@@ -741,102 +3397,246 @@ int sfs_fclose(int fd) {
  * @return number of bytes written, if successful.
  * @return -1, otherwise.
  */
-int sfs_fwrite(int fd, const char *buf, int length) {
+int do_fwrite(int fd, const char *buf, int length) {
   // If the file has not been opened.
-  if (g_fdt[fd].i_node_idx == -1) {
+  if (!fdt_lock_entry(fd)) {
     print_error("Cannot write to a file that is not opened.");
     return -1;
   }
 
-  i_node *node = &g_inode_table[g_fdt[fd].i_node_idx];
-  char *buf_cpy = buf;
-  int file_size = node->size, ptr = g_fdt[fd].read_write_pointer, total_bytes_written = 0;
-  while (length > 0) {
-    int bytes_to_write = min(FILE_SYSTEM_BLOCK_SIZE - ptr % FILE_SYSTEM_BLOCK_SIZE,
-                             length >= FILE_SYSTEM_BLOCK_SIZE ? FILE_SYSTEM_BLOCK_SIZE : length);
-    int block_id;
-
-    if (ptr % FILE_SYSTEM_BLOCK_SIZE == 0 && ptr >= file_size) {
-      // We are running out of blocks, assign new one.
-      block_id = inode_assign_new_block(node);
-
-      // If we cannot allocate more blocks,
-      // then there is an error.
-      if (block_id == -1) {
-        print_error("Cannot allocate more blocks.");
-        return -1;
-      }
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_wrlock(inode_lock);
+  int total_bytes_written = fdt_write_at(fd, buf, length, g_fdt[fd].read_write_pointer);
+  if (total_bytes_written != -1) g_fdt[fd].read_write_pointer += total_bytes_written;
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
 
-      char b[FILE_SYSTEM_BLOCK_SIZE];
-      memcpy(b, buf_cpy, bytes_to_write);
-      write_blocks(block_id, 1, b);
-      file_size += bytes_to_write;
-    } else {
-      // Simple get the designate block.
-      block_id = inode_get_block_id_by_offset(node, ptr);
+  return total_bytes_written;
+}
 
-      char b[FILE_SYSTEM_BLOCK_SIZE];
-      read_blocks(block_id, 1, b);
-      memcpy(b + ptr % FILE_SYSTEM_BLOCK_SIZE, buf_cpy, bytes_to_write);
-      write_blocks(block_id, 1, b);
-      file_size = max(file_size, ptr + bytes_to_write);
-    }
+/**
+ * @brief
+ * Write to a file, see do_fwrite(),
+ * and time the call.
+ */
+int sfs_fwrite(int fd, const char *buf, int length) {
+  long long start_ns = stats_clock_ns();
+  int result = do_fwrite(fd, buf, length);
+  stats_record_latency(SFS_OP_FWRITE, start_ns);
+  return result;
+}
 
-    buf_cpy += bytes_to_write;
-    ptr += bytes_to_write;
-    length -= bytes_to_write;
-    total_bytes_written += bytes_to_write;
+/**
+ * @brief
+ * Read messages from the file.
+ * @param fd The file descriptor.
+ * @param buf The buffer to which the message is written.
+ * @param length The length of the message to read.
+ * @return number of bytes read, if successful.
+ * @return -1, otherwise.
+ */
+int do_fread(int fd, char *buf, int length) {
+  // If the file has not been opened.
+  if (!fdt_lock_entry(fd)) {
+    print_error("Cannot read a file that is not opened.");
+    return -1;
   }
 
-  node->size = file_size;
-  flush_bitmap();
-  flush_i_node_table();
-  g_fdt[fd].read_write_pointer = ptr;
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_rdlock(inode_lock);
+  int total_bytes_read = fdt_read_at(fd, buf, length, g_fdt[fd].read_write_pointer, true);
+  g_fdt[fd].read_write_pointer += total_bytes_read;
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
+
+  return total_bytes_read;
+}
+
+/**
+ * @brief
+ * Read from a file, see do_fread(),
+ * and time the call.
+ */
+int sfs_fread(int fd, char *buf, int length) {
+  long long start_ns = stats_clock_ns();
+  int result = do_fread(fd, buf, length);
+  stats_record_latency(SFS_OP_FREAD, start_ns);
+  return result;
+}
+
+/**
+ * @brief
+ * Write to a file at an offset, leaving
+ * its read/write pointer alone.
+ * @param fd The file descriptor.
+ * @param buf The buffer to write.
+ * @param length The length of the message.
+ * @param loc The offset to write at.
+ * @return number of bytes written, if successful.
+ * @return -1, otherwise.
+ */
+int do_pwrite(int fd, const char *buf, int length, int loc) {
+  if (loc < 0 || length < 0 || length > INT32_MAX - loc) return -1;
+  if (!fdt_lock_entry(fd)) {
+    print_error("Cannot write to a file that is not opened.");
+    return -1;
+  }
+
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_wrlock(inode_lock);
+  int total_bytes_written = fdt_write_at(fd, buf, length, loc);
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
 
   return total_bytes_written;
 }
 
 /**
  * @brief
- * Read messages from the file.
+ * Write to a file at an offset, see do_pwrite(),
+ * and time the call.
+ */
+int sfs_pwrite(int fd, const char *buf, int length, int loc) {
+  long long start_ns = stats_clock_ns();
+  int result = do_pwrite(fd, buf, length, loc);
+  stats_record_latency(SFS_OP_FWRITE, start_ns);
+  return result;
+}
+
+/**
+ * @brief
+ * Read from a file at an offset, leaving its
+ * read/write pointer alone. Readers sharing
+ * a file descriptor do not wait for each other.
  * @param fd The file descriptor.
  * @param buf The buffer to which the message is written.
  * @param length The length of the message to read.
- * @return 1, if success.
- * @return 0, otherwise.
+ * @param loc The offset to read at.
+ * @return number of bytes read, if successful.
+ * @return -1, otherwise.
  */
-int sfs_fread(int fd, char *buf, int length) {
-  // If the file has not been opened.
-  if (g_fdt[fd].i_node_idx == -1) {
-    print_error("Cannot write to a file that is not opened.");
+int do_pread(int fd, char *buf, int length, int loc) {
+  if (loc < 0 || length < 0 || length > INT32_MAX - loc) return -1;
+  pthread_rwlock_rdlock(&g_dir_lock);
+  if (!fdt_is_open(fd)) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    print_error("Cannot read a file that is not opened.");
     return -1;
   }
 
-  i_node *node = &g_inode_table[g_fdt[fd].i_node_idx];
+  // Only one reader gets the entry. The i-Node lock keeps
+  // the entry open, and its tail still, for the others.
+  bool owns_entry = pthread_mutex_trylock(&g_fdt[fd].lock) == 0;
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_rdlock(inode_lock);
+  pthread_rwlock_unlock(&g_dir_lock);
+  int total_bytes_read = fdt_read_at(fd, buf, length, loc, owns_entry);
+  pthread_rwlock_unlock(inode_lock);
+  if (owns_entry) fdt_unlock_entry(fd);
+
+  return total_bytes_read;
+}
+
+/**
+ * @brief
+ * Read a file at an offset, see do_pread(),
+ * and time the call.
+ */
+int sfs_pread(int fd, char *buf, int length, int loc) {
+  long long start_ns = stats_clock_ns();
+  int result = do_pread(fd, buf, length, loc);
+  stats_record_latency(SFS_OP_FREAD, start_ns);
+  return result;
+}
+
+/**
+ * @brief
+ * Write the buffers to a file, one after the
+ * other, as a single write at its read/write
+ * pointer.
+ * @param fd The file descriptor.
+ * @param iov The buffers to write.
+ * @param iovcnt The number of buffers.
+ * @return number of bytes written, if successful.
+ * @return -1, otherwise.
+ */
+int do_writev(int fd, const struct iovec *iov, int iovcnt) {
+  long long length = 0;
+  for (int i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+  if (iovcnt < 0 || length > INT32_MAX) return -1;
+  if (iovcnt == 1) return do_fwrite(fd, (const char *)iov[0].iov_base, (int)length);
+
+  // Gather the buffers, so that the blocks they
+  // make up are written in runs and committed once.
+  char *buf = (char *)malloc(max(1, (int)length));
   char *buf_cpy = buf;
-  int ptr = g_fdt[fd].read_write_pointer, total_bytes_read = 0, file_size = node->size;
-  while (length > 0 && ptr < node->size) {
-    int bytes_to_read = min(FILE_SYSTEM_BLOCK_SIZE - ptr % FILE_SYSTEM_BLOCK_SIZE,
-                            length >= FILE_SYSTEM_BLOCK_SIZE ? FILE_SYSTEM_BLOCK_SIZE : length);
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(buf_cpy, iov[i].iov_base, iov[i].iov_len);
+    buf_cpy += iov[i].iov_len;
+  }
+  int total_bytes_written = do_fwrite(fd, buf, (int)length);
+  free(buf);
+  return total_bytes_written;
+}
 
-    // Calibrate the bytes_to_read with respect to file size.
-    bytes_to_read = min(bytes_to_read, file_size - ptr);
+/**
+ * @brief
+ * Write to a file from several buffers, see do_writev(),
+ * and time the call.
+ */
+int sfs_writev(int fd, const struct iovec *iov, int iovcnt) {
+  long long start_ns = stats_clock_ns();
+  int result = do_writev(fd, iov, iovcnt);
+  stats_record_latency(SFS_OP_FWRITE, start_ns);
+  return result;
+}
 
-    int block_id = inode_get_block_id_by_offset(node, ptr);
-    char block_data[1024];
-    read_blocks(block_id, 1, block_data);
-    memcpy(buf_cpy, block_data + ptr % FILE_SYSTEM_BLOCK_SIZE, bytes_to_read);
-    buf_cpy += bytes_to_read;
-    ptr += bytes_to_read;
-    length -= bytes_to_read;
-    total_bytes_read += bytes_to_read;
+/**
+ * @brief
+ * Fill the buffers from a file, one after the
+ * other, starting at its read/write pointer.
+ * @param fd The file descriptor.
+ * @param iov The buffers to fill.
+ * @param iovcnt The number of buffers.
+ * @return number of bytes read, if successful.
+ * @return -1, otherwise.
+ */
+int do_readv(int fd, const struct iovec *iov, int iovcnt) {
+  if (iovcnt < 0) return -1;
+  if (!fdt_lock_entry(fd)) {
+    print_error("Cannot read a file that is not opened.");
+    return -1;
   }
 
-  g_fdt[fd].read_write_pointer = ptr;
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_rdlock(inode_lock);
+  int total_bytes_read = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    int room = INT32_MAX - total_bytes_read;
+    int length = iov[i].iov_len < (size_t)room ? (int)iov[i].iov_len : room;
+    int bytes_read = fdt_read_at(fd, (char *)iov[i].iov_base, length, g_fdt[fd].read_write_pointer, true);
+    g_fdt[fd].read_write_pointer += bytes_read;
+    total_bytes_read += bytes_read;
+    if (bytes_read < length) break;
+  }
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
 
   return total_bytes_read;
 }
 
+/**
+ * @brief
+ * Read a file into several buffers, see do_readv(),
+ * and time the call.
+ */
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt) {
+  long long start_ns = stats_clock_ns();
+  int result = do_readv(fd, iov, iovcnt);
+  stats_record_latency(SFS_OP_FREAD, start_ns);
+  return result;
+}
+
 /**
  * @brief
  * Adjust the read/write pointer of a file.
@@ -847,18 +3647,115 @@ int sfs_fread(int fd, char *buf, int length) {
  * @return -1, otherwise.
  */
 int sfs_fseek(int fd, int loc) {
-  fdt_entry *file = &g_fdt[fd];
-
-  // If the fd is invalid.
-  if (file->i_node_idx == -1) {
+  // If the fd is invalid, or the location is.
+  if (loc < 0) return -1;
+  if (!fdt_lock_entry(fd)) {
     print_error("The file to seek has not been opened.");
     return -1;
   }
 
+  fdt_entry *file = &g_fdt[fd];
   file->read_write_pointer = loc;
+  fdt_unlock_entry(fd);
   return 1;
 }
 
+/**
+ * @brief
+ * Cut a file, or extend it with zeros, to the
+ * specified size. Only the blocks past the new
+ * end of the file are freed, and the directory
+ * entry stays as it is.
+ * @param fd The file descriptor.
+ * @param size The new size of the file.
+ * @return 1, if success.
+ * @return -1, otherwise.
+ */
+int sfs_ftruncate(int fd, int size) {
+  if (size < 0) return -1;
+  if (!fdt_lock_entry(fd)) {
+    print_error("Cannot truncate a file that is not opened.");
+    return -1;
+  }
+
+  int i_node_idx = g_fdt[fd].i_node_idx;
+  pthread_rwlock_t *inode_lock = &g_inode_locks[i_node_idx];
+  pthread_rwlock_wrlock(inode_lock);
+  i_node *node = inode_get(i_node_idx);
+  int result = 1;
+  if (fdt_flush_delayed(fd) == -1) {
+    result = -1;
+  } else if (size > node->size) {
+    // Growing is a write of zeros past the end.
+    int length = size - node->size;
+    char *zeros = (char *)calloc(length, 1);
+    if (fdt_write_at(fd, zeros, length, node->size) == -1) result = -1;
+    free(zeros);
+  } else if (size < node->size && (node->flags & I_NODE_INLINE_DATA)) {
+    memset(inode_inline_data(node) + size, 0, node->size - size);
+    node->size = size;
+    inode_mark_dirty(i_node_idx);
+    commit_operation();
+  } else if (size < node->size) {
+    int num_of_blocks = calculate_block_length(size);
+    fdt_entry *entry = &g_fdt[fd];
+    if (entry->tail_block_idx >= num_of_blocks) entry->tail_block_idx = -1;
+
+    // Clear the rest of the new last block, so that
+    // growing the file again reads back zeros.
+    int block_offset = size % FILE_SYSTEM_BLOCK_SIZE;
+    if (block_offset != 0) {
+      int block_idx = num_of_blocks - 1;
+      if (entry->tail_block_idx == block_idx) {
+        memset(entry->tail + block_offset, 0, FILE_SYSTEM_BLOCK_SIZE - block_offset);
+      } else {
+        char block_data[FILE_SYSTEM_BLOCK_SIZE];
+        int block_id = inode_get_block_id(node, block_idx);
+        cache_read_blocks(block_id, 1, block_data);
+        memset(block_data + block_offset, 0, FILE_SYSTEM_BLOCK_SIZE - block_offset);
+        cache_write_blocks(block_id, 1, block_data);
+      }
+    }
+
+    inode_free_blocks_from(i_node_idx, num_of_blocks);
+    fdt_invalidate_block_map(i_node_idx);
+    entry->readahead_end_idx = min(entry->readahead_end_idx, num_of_blocks);
+    node->size = size;
+    inode_mark_dirty(i_node_idx);
+    commit_operation();
+  }
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
+
+  return result;
+}
+
+/**
+ * @brief
+ * Delete a file from the root directory,
+ * without committing. Call it with
+ * g_dir_lock write locked.
+ * @param root_entry The directory entry of the file.
+ */
+void remove_file(directory_entry *root_entry) {
+  int inode_id = root_entry->i_node_id;
+
+  // Clear fdt and the i-Node table, once the calls still using them are done.
+  int fd = g_inode_fd[inode_id];
+  if (fd != -1) pthread_mutex_lock(&g_fdt[fd].lock);
+  pthread_rwlock_wrlock(&g_inode_locks[inode_id]);
+  if (fd != -1) fdt_close_entry(fd);
+  inode_reset(inode_id);
+  pthread_rwlock_unlock(&g_inode_locks[inode_id]);
+  if (fd != -1) pthread_mutex_unlock(&g_fdt[fd].lock);
+
+  // Clear root directory.
+  root_index_remove(root_entry - g_root_directory_table);
+  root_entry->i_node_id = -1;
+  memset(root_entry->file_name, '\0', MAX_FILE_NAME_SIZE);
+  root_mark_dirty(root_entry);
+}
+
 /**
  * @brief
  * Delete a file.
@@ -866,31 +3763,311 @@ int sfs_fseek(int fd, int loc) {
  * @return 1, if success.
  * @return -1, otherwise.
  */
-int sfs_remove(char *filename) {
+int do_remove(char *filename) {
+  pthread_rwlock_wrlock(&g_dir_lock);
   directory_entry *root_entry = root_get_directory_entry(filename);
 
   // If the file to delete does not exist.
-  if (root_entry == NULL) return -1;
+  if (root_entry == NULL) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    return -1;
+  }
 
-  int inode_id = root_entry->i_node_id;
+  remove_file(root_entry);
+  pthread_rwlock_unlock(&g_dir_lock);
+  commit_operation();
+
+  return 1;
+}
+
+/**
+ * @brief
+ * Delete a file, see do_remove(),
+ * and time the call.
+ */
+int sfs_remove(char *filename) {
+  long long start_ns = stats_clock_ns();
+  int result = do_remove(filename);
+  stats_record_latency(SFS_OP_REMOVE, start_ns);
+  return result;
+}
 
-  // Clear fdt.
-  for (int i = 0; i < NUM_OF_FILES; ++i)
-    if (g_fdt[i].i_node_idx == inode_id) {
-      g_fdt[i].i_node_idx = -1;
-      g_fdt[i].read_write_pointer = -1;
+/**
+ * @brief
+ * Create many empty files at once, without
+ * opening them. The batch commits as one
+ * operation, or as a few if it outgrows
+ * the journal, in which case a crash keeps
+ * the files of the transactions committed.
+ * @param filenames The names of the files.
+ * @param count The number of files.
+ * @return The number of files created. Names that exist already or are too long are skipped.
+ */
+int sfs_create_many(char **filenames, int count) {
+  int num_of_created = 0;
+  pthread_rwlock_wrlock(&g_dir_lock);
+  for (int i = 0; i < count; i++) {
+    if (strlen(filenames[i]) >= MAX_FILE_NAME_SIZE || root_get_directory_entry(filenames[i]) != NULL) continue;
+    if (create_file(filenames[i]) == -1) {
+      print_error("Cannot create more files because either the root or the iNode table is full.");
       break;
     }
+    num_of_created++;
+    commit_batch_step();
+  }
+  pthread_rwlock_unlock(&g_dir_lock);
+  commit_operation();
+  return num_of_created;
+}
 
-  // Clear i-Node table.
-  inode_reset(inode_id);
+/**
+ * @brief
+ * Delete many files at once, committed
+ * as one operation, see sfs_create_many().
+ * @param filenames The names of the files.
+ * @param count The number of files.
+ * @return The number of files deleted. Names that do not exist are skipped.
+ */
+int sfs_remove_many(char **filenames, int count) {
+  int num_of_removed = 0;
+  pthread_rwlock_wrlock(&g_dir_lock);
+  for (int i = 0; i < count; i++) {
+    directory_entry *root_entry = root_get_directory_entry(filenames[i]);
+    if (root_entry == NULL) continue;
+    remove_file(root_entry);
+    num_of_removed++;
+    commit_batch_step();
+  }
+  pthread_rwlock_unlock(&g_dir_lock);
+  commit_operation();
+  return num_of_removed;
+}
 
-  // Clear root directory.
-  root_entry->i_node_id = -1;
-  memset(root_entry->file_name, '\0', MAX_FILE_EXTENSION_LENGTH + MAX_FILE_NAME_LENGTH + 1);
+/**
+ * @brief
+ * Get the sizes of many files at once,
+ * looking them up under a single lock.
+ * @param filenames The names of the files.
+ * @param count The number of files.
+ * @param sizes The array to which the sizes are written, -1 for the files that do not exist.
+ * @return The number of files that exist.
+ */
+int sfs_stat_many(char **filenames, int count, int *sizes) {
+  int num_of_found = 0;
+  pthread_rwlock_rdlock(&g_dir_lock);
+  for (int i = 0; i < count; i++) {
+    directory_entry *root_entry = root_get_directory_entry(filenames[i]);
+    sizes[i] = -1;
+    if (root_entry == NULL) continue;
+    pthread_rwlock_rdlock(&g_inode_locks[root_entry->i_node_id]);
+    sizes[i] = fdt_get_file_size(root_entry->i_node_id);
+    pthread_rwlock_unlock(&g_inode_locks[root_entry->i_node_id]);
+    num_of_found++;
+  }
+  pthread_rwlock_unlock(&g_dir_lock);
+  return num_of_found;
+}
+
+/**
+ * @brief
+ * Make a file durable. The journal commits
+ * as a whole, so every other finished
+ * operation becomes durable along with it.
+ * @param fd The file descriptor.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int sfs_fsync(int fd) {
+  if (!fdt_lock_entry(fd)) {
+    print_error("Cannot sync a file that is not opened.");
+    return -1;
+  }
 
-  flush_root_directory_table();
+  pthread_rwlock_t *inode_lock = &g_inode_locks[g_fdt[fd].i_node_idx];
+  pthread_rwlock_wrlock(inode_lock);
+  int result = fdt_flush_delayed(fd) == -1 ? -1 : 0;
+  fdt_flush_tail(fd);
+  pthread_rwlock_unlock(inode_lock);
+  fdt_unlock_entry(fd);
 
-  return 1;
+  commit_operation_durably();
+  return result;
+}
+
+/**
+ * @brief
+ * Make every finished operation durable.
+ * @return 0, if success.
+ * @return -1, otherwise.
+ */
+int sfs_sync() {
+  if (g_fdt == NULL) return -1;
+
+  // The tails and the delayed data of the open files go to the cache first.
+  int result = 0;
+  pthread_rwlock_rdlock(&g_dir_lock);
+  for (int fd = 0; fd < NUM_OF_FILES; fd++) {
+    if (!fdt_is_open(fd)) continue;
+    pthread_mutex_lock(&g_fdt[fd].lock);
+    pthread_rwlock_wrlock(&g_inode_locks[g_fdt[fd].i_node_idx]);
+    if (fdt_flush_delayed(fd) == -1) result = -1;
+    fdt_flush_tail(fd);
+    pthread_rwlock_unlock(&g_inode_locks[g_fdt[fd].i_node_idx]);
+    pthread_mutex_unlock(&g_fdt[fd].lock);
+  }
+  pthread_rwlock_unlock(&g_dir_lock);
+
+  commit_operation_durably();
+  return result;
+}
+
+/**
+ * @brief
+ * Defragment a file, moving its data blocks into
+ * a single run of free blocks if one is long
+ * enough. The calls using the file wait meanwhile.
+ * @param filename The name of the file.
+ * @return The number of blocks moved.
+ * @return 0, if the file is contiguous already, or no run of free blocks is long enough.
+ * @return -1, if the file does not exist.
+ */
+int sfs_defrag_file(char *filename) {
+  if (g_fdt == NULL) return -1;
+  pthread_rwlock_rdlock(&g_dir_lock);
+  directory_entry *root_entry = root_get_directory_entry(filename);
+  if (root_entry == NULL) {
+    pthread_rwlock_unlock(&g_dir_lock);
+    return -1;
+  }
+
+  // An open file gives its tail and its delayed data blocks first.
+  int inode_id = root_entry->i_node_id, fd = g_inode_fd[inode_id], moved = 0;
+  if (fd != -1) pthread_mutex_lock(&g_fdt[fd].lock);
+  pthread_rwlock_wrlock(&g_inode_locks[inode_id]);
+  if (fd == -1 || fdt_flush_delayed(fd) == 0) {
+    if (fd != -1) fdt_flush_tail(fd);
+    moved = inode_relocate_blocks(inode_id);
+    if (moved > 0) {
+      fdt_invalidate_block_map(inode_id);
+      commit_operation();
+    }
+  }
+  pthread_rwlock_unlock(&g_inode_locks[inode_id]);
+  if (fd != -1) pthread_mutex_unlock(&g_fdt[fd].lock);
+  pthread_rwlock_unlock(&g_dir_lock);
+
+  return moved;
+}
+
+/**
+ * @brief
+ * Defragment the next few files of the root
+ * directory, see sfs_defrag_file(). Each call
+ * resumes where the previous one stopped, and
+ * starts over once it reaches the end, so the
+ * calls may be spread out over time.
+ * @param max_files The number of files to visit.
+ * @return The number of files whose blocks were moved.
+ */
+int sfs_defrag(int max_files) {
+  if (g_fdt == NULL) return 0;
+  int num_of_defragmented = 0;
+  char filename[MAX_FILE_NAME_SIZE];
+  for (int i = 0; i < max_files; i++) {
+    pthread_rwlock_wrlock(&g_dir_lock);
+    directory_entry *root_entry = root_get_next_file(&g_defrag_cursor);
+    if (root_entry == NULL) {
+      g_defrag_cursor = 0;
+      root_entry = root_get_next_file(&g_defrag_cursor);
+    }
+    if (root_entry != NULL) strcpy(filename, root_entry->file_name);
+    pthread_rwlock_unlock(&g_dir_lock);
+
+    if (root_entry == NULL) break;
+    if (sfs_defrag_file(filename) > 0) num_of_defragmented++;
+  }
+  return num_of_defragmented;
+}
+
+/**
+ * @brief
+ * Take a snapshot of the counters and
+ * the latency histograms.
+ * @param stats The snapshot.
+ */
+void sfs_get_stats(sfs_stats *stats) {
+  // Every field of sfs_stats is a long long.
+  const long long *src = (const long long *)&g_stats;
+  long long *dst = (long long *)stats;
+  for (size_t i = 0; i < sizeof(sfs_stats) / sizeof(long long); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+  disk_stats disk;
+  get_disk_stats(&disk);
+  stats->disk_reads = disk.reads;
+  stats->disk_writes = disk.writes;
+  stats->disk_bytes_read = disk.bytes_read;
+  stats->disk_bytes_written = disk.bytes_written;
+  stats->disk_syncs = disk.syncs;
+}
+
+/**
+ * @brief
+ * Zero the counters and the latency
+ * histograms. Every mount does so too.
+ */
+void sfs_reset_stats() {
+  long long *counters = (long long *)&g_stats;
+  for (size_t i = 0; i < sizeof(sfs_stats) / sizeof(long long); i++)
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  reset_disk_stats();
+}
+
+/**
+ * @brief
+ * Write a snapshot of the stats as text, one
+ * "name value" line per counter. A histogram
+ * is a line of its bucket counts.
+ * @param buf The buffer, or NULL to only measure the text.
+ * @param size The size of the buffer, in bytes.
+ * @return The length of the whole text, like snprintf(); it is cut short if not less than size.
+ */
+int sfs_format_stats(char *buf, int size) {
+  static const char *op_names[SFS_NUM_OF_OPS] = {"fopen", "fread", "fwrite", "remove"};
+  sfs_stats stats;
+  sfs_get_stats(&stats);
+
+  int length = 0;
+  length = stats_append(buf, size, length, "disk_reads %lld\ndisk_writes %lld\n", stats.disk_reads, stats.disk_writes);
+  length = stats_append(buf, size, length, "disk_bytes_read %lld\ndisk_bytes_written %lld\n", stats.disk_bytes_read,
+                        stats.disk_bytes_written);
+  length = stats_append(buf, size, length, "disk_syncs %lld\n", stats.disk_syncs);
+  length = stats_append(buf, size, length, "cache_hits %lld\ncache_misses %lld\n", stats.cache_hits,
+                        stats.cache_misses);
+  length = stats_append(buf, size, length, "metadata_flushes %lld\nmetadata_blocks %lld\n", stats.metadata_flushes,
+                        stats.metadata_blocks);
+  length = stats_append(buf, size, length, "journal_commits %lld\n", stats.journal_commits);
+  for (int op = 0; op < SFS_NUM_OF_OPS; op++) {
+    sfs_latency_histogram *histogram = &stats.latency[op];
+    length = stats_append(buf, size, length, "%s_count %lld\n%s_total_us %lld\n%s_max_us %lld\n%s_histogram",
+                          op_names[op], histogram->count, op_names[op], histogram->total_us, op_names[op],
+                          histogram->max_us, op_names[op]);
+    for (int i = 0; i < SFS_LATENCY_BUCKETS; i++)
+      length = stats_append(buf, size, length, " %lld", histogram->buckets[i]);
+    length = stats_append(buf, size, length, "\n");
+  }
+  return length;
+}
+
+/**
+ * @brief
+ * Turn the error messages on or off, in
+ * place of the SFS_VERBOSE environment
+ * variable read at mount.
+ * @param verbose Whether to print them.
+ */
+void sfs_set_verbose(int verbose) {
+  g_verbose = verbose != 0;
+  g_verbose_is_set = true;
 }
 #pragma endregion
\ No newline at end of file
@@ -1,14 +1,72 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <sys/uio.h>
+
 #define MAXFILENAME 100
 
 // You can add more into this file.
 
+// How durable the calls are, chosen at mount.
+#define SFS_WRITE_THROUGH 0  // Every call is durable when it returns.
+#define SFS_WRITE_BACK 1     // Calls become durable at sfs_fsync() and sfs_sync().
+
+// The volume geometry chosen at format time, and the mount options.
+typedef struct sfs_options {
+  int block_size;   // The size of each block, in bytes. A power of two, at least 512.
+  int num_blocks;   // The total number of blocks on the disk.
+  int num_i_nodes;  // The number of i-Nodes, including the one of the root directory.
+  int journal_length;  // The number of blocks of the metadata journal, 0 for none.
+  int durability;      // SFS_WRITE_THROUGH or SFS_WRITE_BACK, for this mount only.
+} sfs_options;
+
+// The calls timed by the latency histograms.
+#define SFS_OP_FOPEN 0
+#define SFS_OP_FREAD 1   // Along with sfs_pread() and sfs_readv().
+#define SFS_OP_FWRITE 2  // Along with sfs_pwrite() and sfs_writev().
+#define SFS_OP_REMOVE 3
+#define SFS_NUM_OF_OPS 4
+
+// Bucket 0 counts the calls taking under 1 us, bucket i those taking
+// [2^(i-1), 2^i) us, and the last one every call slower than that.
+#define SFS_LATENCY_BUCKETS 24
+
+typedef struct sfs_latency_histogram {
+  long long count;     // The number of calls.
+  long long total_us;  // Their total time, in microseconds.
+  long long max_us;    // The slowest of them, in microseconds.
+  long long buckets[SFS_LATENCY_BUCKETS];
+} sfs_latency_histogram;
+
+// What the file system did since the last mount, or sfs_reset_stats().
+typedef struct sfs_stats {
+  long long disk_reads;          // Calls reading blocks off the disk.
+  long long disk_writes;         // Calls writing blocks to the disk.
+  long long disk_bytes_read;
+  long long disk_bytes_written;
+  long long disk_syncs;
+  long long cache_hits;          // Blocks read out of the block cache, or out of a memory-mapped disk.
+  long long cache_misses;        // Blocks the block cache had to read.
+  long long metadata_flushes;    // Write-backs of the metadata tables, journaled or in place.
+  long long metadata_blocks;     // The metadata blocks they wrote.
+  long long journal_commits;     // Transactions committed through the journal.
+  sfs_latency_histogram latency[SFS_NUM_OF_OPS];
+} sfs_stats;
+
+void sfs_default_options(sfs_options *);
+
 void mksfs(int);
 
+void mksfs_with_options(int, const sfs_options *);
+
 int sfs_getnextfilename(char *);
 
+int sfs_opendir();
+
+int sfs_readdir(int, char *);
+
+int sfs_closedir(int);
+
 int sfs_getfilesize(const char *);
 
 int sfs_fopen(char *);
@@ -21,6 +79,38 @@ int sfs_fread(int, char *, int);
 
 int sfs_fseek(int, int);
 
+int sfs_ftruncate(int, int);
+
+int sfs_pread(int, char *, int, int);
+
+int sfs_pwrite(int, const char *, int, int);
+
+int sfs_readv(int, const struct iovec *, int);
+
+int sfs_writev(int, const struct iovec *, int);
+
 int sfs_remove(char *);
 
+int sfs_create_many(char **, int);
+
+int sfs_remove_many(char **, int);
+
+int sfs_stat_many(char **, int, int *);
+
+int sfs_fsync(int);
+
+int sfs_sync();
+
+int sfs_defrag_file(char *);
+
+int sfs_defrag(int);
+
+void sfs_get_stats(sfs_stats *);
+
+void sfs_reset_stats();
+
+int sfs_format_stats(char *, int);
+
+void sfs_set_verbose(int);
+
 #endif
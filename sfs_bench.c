@@ -0,0 +1,343 @@
+/* sfs_bench.c
+ *
+ * Benchmarks of the Simple File System. Every workload starts from a
+ * freshly formatted volume and draws its offsets from a seeded
+ * generator, so runs with the same options do the same work. Each
+ * result is a row of CSV, or an object of JSON, on stdout.
+ *
+ * Usage: sfs_bench [-b backend] [-L latency_us] [-w] [-f csv|json] [-s seed] [-q]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BENCH_BLOCK_SIZE 1024
+#define BENCH_NUM_OF_BLOCKS 32768  // A volume of 32 MiB.
+#define BENCH_NUM_OF_I_NODES 1024
+#define BENCH_MAX_IO_SIZE 65536
+
+typedef struct bench_config {
+  const char *backend;  // The disk backend, NULL for the default.
+  double latency_us;    // The latency L of the disk emulator.
+  int durability;       // SFS_WRITE_THROUGH or SFS_WRITE_BACK.
+  int json;             // Whether to print JSON rather than CSV.
+  unsigned seed;        // The seed of the offsets.
+  int scale;            // Divides the amount of work, for quick runs.
+} bench_config;
+
+typedef struct bench_timer {
+  double start;  // When the workload started, in seconds.
+  sfs_stats stats;
+} bench_timer;
+
+bench_config g_config = {NULL, 0, SFS_WRITE_THROUGH, 0, 1, 1};
+int g_num_of_results = 0;
+unsigned long long g_rng_state;
+char g_buffer[BENCH_MAX_IO_SIZE];
+
+/**
+ * @brief
+ * Read the monotonic clock.
+ * @return The time, in seconds.
+ */
+double bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief
+ * Draw the next number of a 64-bit LCG.
+ * @return A pseudo-random number.
+ */
+unsigned bench_random() {
+  g_rng_state = g_rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(g_rng_state >> 33);
+}
+
+/**
+ * @brief
+ * Format (or mount) the benchmark volume,
+ * reseeding the generator for the workload.
+ * @param fresh Whether to format a fresh volume.
+ */
+void bench_mount(int fresh) {
+  sfs_options options;
+  sfs_default_options(&options);
+  options.block_size = BENCH_BLOCK_SIZE;
+  options.num_blocks = BENCH_NUM_OF_BLOCKS;
+  options.num_i_nodes = BENCH_NUM_OF_I_NODES;
+  options.durability = g_config.durability;
+  mksfs_with_options(fresh, &options);
+  g_rng_state = g_config.seed;
+}
+
+/**
+ * @brief
+ * Start timing a workload.
+ * @param timer The timer.
+ */
+void bench_start(bench_timer *timer) {
+  sfs_reset_stats();
+  timer->start = bench_now();
+}
+
+/**
+ * @brief
+ * Stop timing a workload, and print its result.
+ * @param timer The timer.
+ * @param workload The name of the workload.
+ * @param io_size The size of each operation, in bytes, 0 if not applicable.
+ * @param ops The number of operations done.
+ * @param bytes The number of bytes moved.
+ */
+void bench_finish(bench_timer *timer, const char *workload, int io_size, long long ops, long long bytes) {
+  double seconds = bench_now() - timer->start;
+  sfs_get_stats(&timer->stats);
+  double ops_per_sec = seconds > 0 ? ops / seconds : 0;
+  double mib_per_sec = seconds > 0 ? bytes / seconds / (1 << 20) : 0;
+  const char *backend = g_config.backend != NULL ? g_config.backend : "default";
+  const char *durability = g_config.durability == SFS_WRITE_BACK ? "write-back" : "write-through";
+  sfs_stats *stats = &timer->stats;
+
+  if (g_config.json) {
+    printf("%s\n  {\"workload\": \"%s\", \"backend\": \"%s\", \"durability\": \"%s\", \"latency_us\": %g, ",
+           g_num_of_results == 0 ? "[" : ",", workload, backend, durability, g_config.latency_us);
+    printf("\"io_size\": %d, \"ops\": %lld, \"bytes\": %lld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ", io_size,
+           ops, bytes, seconds, ops_per_sec);
+    printf("\"mib_per_sec\": %.2f, \"disk_reads\": %lld, \"disk_writes\": %lld, \"disk_syncs\": %lld, ", mib_per_sec,
+           stats->disk_reads, stats->disk_writes, stats->disk_syncs);
+    printf("\"cache_hits\": %lld, \"cache_misses\": %lld}", stats->cache_hits, stats->cache_misses);
+  } else {
+    if (g_num_of_results == 0)
+      printf("workload,backend,durability,latency_us,io_size,ops,bytes,seconds,ops_per_sec,mib_per_sec,"
+             "disk_reads,disk_writes,disk_syncs,cache_hits,cache_misses\n");
+    printf("%s,%s,%s,%g,%d,%lld,%lld,%.6f,%.1f,%.2f,%lld,%lld,%lld,%lld,%lld\n", workload, backend, durability,
+           g_config.latency_us, io_size, ops, bytes, seconds, ops_per_sec, mib_per_sec, stats->disk_reads,
+           stats->disk_writes, stats->disk_syncs, stats->cache_hits, stats->cache_misses);
+  }
+  fflush(stdout);
+  g_num_of_results++;
+}
+
+/**
+ * @brief
+ * Sequential and random reads and writes of
+ * a single file, at one I/O size.
+ * @param io_size The size of each operation, in bytes.
+ * @param file_size The size of the file, in bytes.
+ */
+void bench_read_write(int io_size, int file_size) {
+  bench_timer timer;
+  int num_of_ios = file_size / io_size;
+  bench_mount(1);
+  int fd = sfs_fopen("bench.dat");
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_ios; i++)
+    if (sfs_fwrite(fd, g_buffer, io_size) != io_size) break;
+  sfs_fsync(fd);
+  bench_finish(&timer, "seq_write", io_size, num_of_ios, (long long)num_of_ios * io_size);
+
+  bench_start(&timer);
+  sfs_fseek(fd, 0);
+  for (int i = 0; i < num_of_ios; i++)
+    if (sfs_fread(fd, g_buffer, io_size) != io_size) break;
+  bench_finish(&timer, "seq_read", io_size, num_of_ios, (long long)num_of_ios * io_size);
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_ios; i++)
+    sfs_pwrite(fd, g_buffer, io_size, (int)(bench_random() % num_of_ios) * io_size);
+  sfs_fsync(fd);
+  bench_finish(&timer, "rand_write", io_size, num_of_ios, (long long)num_of_ios * io_size);
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_ios; i++)
+    sfs_pread(fd, g_buffer, io_size, (int)(bench_random() % num_of_ios) * io_size);
+  bench_finish(&timer, "rand_read", io_size, num_of_ios, (long long)num_of_ios * io_size);
+  sfs_fclose(fd);
+}
+
+/**
+ * @brief
+ * Name the i-th file of a storm.
+ * @param name The buffer to which the name is written.
+ * @param i The number of the file.
+ */
+void bench_file_name(char *name, int i) { sprintf(name, "f%06d.txt", i); }
+
+/**
+ * @brief
+ * Create many small files, stat them, list
+ * the directory, remount it, and remove them.
+ * @param num_of_files The number of files.
+ */
+void bench_small_files(int num_of_files) {
+  bench_timer timer;
+  char name[MAXFILENAME];
+  bench_mount(1);
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_files; i++) {
+    bench_file_name(name, i);
+    int fd = sfs_fopen(name);
+    sfs_fwrite(fd, g_buffer, 100);
+    sfs_fclose(fd);
+  }
+  sfs_sync();
+  bench_finish(&timer, "create", 100, num_of_files, num_of_files * 100LL);
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_files; i++) {
+    bench_file_name(name, bench_random() % num_of_files);
+    sfs_getfilesize(name);
+  }
+  bench_finish(&timer, "stat", 0, num_of_files, 0);
+
+  int num_of_listings = 20, num_of_entries = 0;
+  bench_start(&timer);
+  for (int i = 0; i < num_of_listings; i++) {
+    int dir = sfs_opendir();
+    while (sfs_readdir(dir, name) == 1) num_of_entries++;
+    sfs_closedir(dir);
+  }
+  bench_finish(&timer, "list_dir", 0, num_of_entries, 0);
+
+  // Every mount resets the stats, so the counters are those of the last one.
+  int num_of_mounts = 10;
+  sfs_sync();
+  bench_start(&timer);
+  for (int i = 0; i < num_of_mounts; i++) bench_mount(0);
+  bench_finish(&timer, "mount", 0, num_of_mounts, 0);
+
+  bench_start(&timer);
+  for (int i = 0; i < num_of_files; i++) {
+    bench_file_name(name, i);
+    sfs_remove(name);
+  }
+  sfs_sync();
+  bench_finish(&timer, "remove", 0, num_of_files, 0);
+
+  // The same storm again, in batches.
+  char **names = (char **)malloc(num_of_files * sizeof(char *));
+  int *sizes = (int *)malloc(num_of_files * sizeof(int));
+  for (int i = 0; i < num_of_files; i++) {
+    names[i] = (char *)malloc(MAXFILENAME);
+    bench_file_name(names[i], i);
+  }
+
+  bench_start(&timer);
+  sfs_create_many(names, num_of_files);
+  sfs_sync();
+  bench_finish(&timer, "create_many", 0, num_of_files, 0);
+
+  bench_start(&timer);
+  sfs_stat_many(names, num_of_files, sizes);
+  bench_finish(&timer, "stat_many", 0, num_of_files, 0);
+
+  bench_start(&timer);
+  sfs_remove_many(names, num_of_files);
+  sfs_sync();
+  bench_finish(&timer, "remove_many", 0, num_of_files, 0);
+
+  for (int i = 0; i < num_of_files; i++) free(names[i]);
+  free(names);
+  free(sizes);
+}
+
+/**
+ * @brief
+ * Fill the volume up with files of the I/O
+ * size, until a write comes up short.
+ * @param io_size The size of each write, in bytes.
+ */
+void bench_fill(int io_size) {
+  bench_timer timer;
+  char name[MAXFILENAME];
+  long long num_of_ios = 0, bytes = 0;
+  bench_mount(1);
+
+  bench_start(&timer);
+  for (int i = 0; i < BENCH_NUM_OF_I_NODES - 1; i++) {
+    bench_file_name(name, i);
+    int fd = sfs_fopen(name), written = 0;
+    if (fd < 0) break;
+    for (int j = 0; j < 64 && (written = sfs_fwrite(fd, g_buffer, io_size)) == io_size; j++) {
+      num_of_ios++;
+      bytes += written;
+    }
+    if (written > 0 && written < io_size) bytes += written;
+    sfs_fclose(fd);
+    if (written != io_size) break;
+  }
+  sfs_sync();
+  bench_finish(&timer, "fill", io_size, num_of_ios, bytes);
+}
+
+/**
+ * @brief
+ * Print how to run the benchmarks.
+ * @param program The name of the program.
+ */
+void bench_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-b backend] [-L latency_us] [-w] [-f csv|json] [-s seed] [-q]\n"
+          "  -b  The disk backend: stdio, pread, direct, mmap or ram.\n"
+          "  -L  The latency the disk pays per block written, in microseconds.\n"
+          "  -w  Mount write-back rather than write-through.\n"
+          "  -f  The format of the results, csv (the default) or json.\n"
+          "  -s  The seed of the random offsets.\n"
+          "  -q  Do a tenth of the work, for a quick run.\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  int option;
+  while ((option = getopt(argc, argv, "b:L:wf:s:q")) != -1) {
+    switch (option) {
+      case 'b':
+        g_config.backend = optarg;
+        break;
+      case 'L':
+        g_config.latency_us = atof(optarg);
+        break;
+      case 'w':
+        g_config.durability = SFS_WRITE_BACK;
+        break;
+      case 'f':
+        if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+          bench_usage(argv[0]);
+          return 1;
+        }
+        g_config.json = strcmp(optarg, "json") == 0;
+        break;
+      case 's':
+        g_config.seed = (unsigned)strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        g_config.scale = 10;
+        break;
+      default:
+        bench_usage(argv[0]);
+        return 1;
+    }
+  }
+  if (g_config.backend != NULL && set_disk_backend(g_config.backend) == -1) return 1;
+  set_disk_latency(g_config.latency_us);
+  memset(g_buffer, 'x', sizeof(g_buffer));
+
+  int io_sizes[] = {512, 4096, BENCH_MAX_IO_SIZE};
+  for (int i = 0; i < (int)(sizeof(io_sizes) / sizeof(io_sizes[0])); i++)
+    bench_read_write(io_sizes[i], (8 << 20) / g_config.scale);
+  bench_small_files((BENCH_NUM_OF_I_NODES - 1) / g_config.scale);
+  bench_fill(BENCH_MAX_IO_SIZE);
+
+  if (g_config.json) printf("%s]\n", g_num_of_results == 0 ? "[" : "\n");
+  return 0;
+}
@@ -0,0 +1,174 @@
+/* sfs_test3.c
+ *
+ * Checks that the holes left by writes past the end of a file read back
+ * as zeros, even over blocks freed by a removed file, whether the volume
+ * is mounted write-through or write-back. The removed file fills up the
+ * volume first, so that every block the holes get was one of its blocks.
+ * Writes and reads whose end would not fit in the size of a file fail.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define CHUNK_BYTES 4096 /* The writes of the file removed first */
+#define HOLE_BYTES 19700 /* Where the write past the end starts */
+
+static char test_str[] = "The quick brown fox jumps over the lazy dog.\n";
+
+/* check_hole() - count the bytes of a file in [start, end) that are not zero.
+ */
+int check_hole(int fd, int start, int end)
+{
+  char *buffer = malloc(end - start);
+  int i, nonzero = 0;
+
+  if (sfs_pread(fd, buffer, end - start, start) != end - start) {
+    free(buffer);
+    return end - start;
+  }
+  for (i = 0; i < end - start; i++) {
+    if (buffer[i] != 0) {
+      nonzero++;
+    }
+  }
+  free(buffer);
+  return nonzero;
+}
+
+/* run_test() - fill the volume with a file, remove it, and write past the
+ * end of a new file over the blocks it freed.
+ */
+int run_test(int durability)
+{
+  sfs_options options;
+  char *buffer = malloc(CHUNK_BYTES);
+  int error_count = 0;
+  int fd, nonzero, len = strlen(test_str);
+
+  sfs_default_options(&options);
+  options.durability = durability;
+  mksfs_with_options(1, &options);
+
+  memset(buffer, 'X', CHUNK_BYTES);
+  fd = sfs_fopen("old.txt");
+  while (sfs_fwrite(fd, buffer, CHUNK_BYTES) == CHUNK_BYTES)
+    ;
+  sfs_fclose(fd);
+  sfs_remove("old.txt");
+  sfs_sync();
+
+  /* A write past the end of an empty file. */
+  fd = sfs_fopen("hole.txt");
+  if (sfs_pwrite(fd, test_str, len, HOLE_BYTES) != len) {
+    fprintf(stderr, "ERROR: Write past the end failed\n");
+    error_count++;
+  }
+  nonzero = check_hole(fd, 0, HOLE_BYTES);
+  if (nonzero != 0) {
+    fprintf(stderr, "ERROR: %d of the %d hole bytes are not zero\n", nonzero, HOLE_BYTES);
+    error_count++;
+  }
+
+  /* A write further past the end of a file with blocks already. */
+  if (sfs_pwrite(fd, test_str, len, 2 * HOLE_BYTES + 1) != len) {
+    fprintf(stderr, "ERROR: Second write past the end failed\n");
+    error_count++;
+  }
+  nonzero = check_hole(fd, HOLE_BYTES + len, 2 * HOLE_BYTES + 1);
+  if (nonzero != 0) {
+    fprintf(stderr, "ERROR: %d bytes of the second hole are not zero\n", nonzero);
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  /* The holes are still zero once remounted. */
+  sfs_sync();
+  mksfs_with_options(0, &options);
+  fd = sfs_fopen("hole.txt");
+  if (sfs_getfilesize("hole.txt") != 2 * HOLE_BYTES + 1 + len) {
+    fprintf(stderr, "ERROR: Wrong size %d after the mount\n", sfs_getfilesize("hole.txt"));
+    error_count++;
+  }
+  nonzero = check_hole(fd, 0, HOLE_BYTES) + check_hole(fd, HOLE_BYTES + len, 2 * HOLE_BYTES + 1);
+  if (nonzero != 0) {
+    fprintf(stderr, "ERROR: %d hole bytes are not zero after the mount\n", nonzero);
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  free(buffer);
+  return error_count;
+}
+
+/* run_overflow_test() - write and read at offsets whose end overflows an
+ * int, in both an inline file and a file with data blocks.
+ */
+int run_overflow_test(int durability)
+{
+  sfs_options options;
+  char buffer[2048];
+  int error_count = 0;
+  int fd, size;
+
+  sfs_default_options(&options);
+  options.durability = durability;
+  mksfs_with_options(1, &options);
+  memset(buffer, 'Y', sizeof(buffer));
+
+  fd = sfs_fopen("inline.txt");
+  sfs_fwrite(fd, test_str, strlen(test_str));
+  if (sfs_pwrite(fd, buffer, 100, INT_MAX - 10) != -1) {
+    fprintf(stderr, "ERROR: Write past INT_MAX in an inline file did not fail\n");
+    error_count++;
+  }
+  if (sfs_pread(fd, buffer, 100, INT_MAX - 10) != -1) {
+    fprintf(stderr, "ERROR: Read past INT_MAX did not fail\n");
+    error_count++;
+  }
+  if (sfs_fseek(fd, INT_MAX - 5) != 1 || sfs_fwrite(fd, buffer, 100) != -1) {
+    fprintf(stderr, "ERROR: Write at the pointer past INT_MAX did not fail\n");
+    error_count++;
+  }
+  if (sfs_fseek(fd, -1) != -1) {
+    fprintf(stderr, "ERROR: Seek to a negative offset did not fail\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  fd = sfs_fopen("blocks.txt");
+  sfs_fwrite(fd, buffer, sizeof(buffer));
+  if (sfs_pwrite(fd, buffer, 100, INT_MAX - 10) != -1) {
+    fprintf(stderr, "ERROR: Write past INT_MAX in a file with blocks did not fail\n");
+    error_count++;
+  }
+  if (sfs_fseek(fd, INT_MAX - 5) != 1 || sfs_fwrite(fd, buffer, 100) != -1) {
+    fprintf(stderr, "ERROR: Write at the pointer past INT_MAX did not fail\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  /* Neither file changed. */
+  size = sfs_getfilesize("inline.txt") + sfs_getfilesize("blocks.txt");
+  if (size != (int)strlen(test_str) + (int)sizeof(buffer)) {
+    fprintf(stderr, "ERROR: Failed writes changed the files, %d bytes\n", size);
+    error_count++;
+  }
+  return error_count;
+}
+
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+
+  error_count += run_test(SFS_WRITE_THROUGH);
+  error_count += run_test(SFS_WRITE_BACK);
+  error_count += run_overflow_test(SFS_WRITE_THROUGH);
+  error_count += run_overflow_test(SFS_WRITE_BACK);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
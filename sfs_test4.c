@@ -0,0 +1,257 @@
+/* sfs_test4.c
+ *
+ * Checks that the journal keeps a volume consistent across a crash. A
+ * child process writes records to a file, and creates a file now and
+ * then, acknowledging each call to its parent once it is durable. Its
+ * disk is a file behind a block device that crashes the process at the
+ * k-th block write, leaving that write torn halfway. The parent then
+ * remounts the disk, which replays the journal, and checks that every
+ * acknowledged record and file survived and that no record is torn. The
+ * rounds crash at every write of the workload in turn.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define RECORD_BYTES 1500 /* Records straddle blocks */
+#define NUM_RECORDS 24
+#define FILE_EVERY 4      /* A new file every this many records */
+
+/* The number of block writes left before the crash, -1 for none */
+static int writes_left = -1;
+
+static int crash_open(block_device *dev, char *filename, int fresh)
+{
+  int fd = open(filename, fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (fresh && ftruncate(fd, (off_t)dev->block_size * dev->num_blocks) == -1) {
+    close(fd);
+    return -1;
+  }
+  dev->private_data = (void *)(long)fd;
+  return 0;
+}
+
+static int crash_read(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+  size_t size = (size_t)nblocks * dev->block_size;
+
+  if (pread((int)(long)dev->private_data, buffer, size, (off_t)start_address * dev->block_size) != (ssize_t)size) {
+    return -1;
+  }
+  return nblocks;
+}
+
+/* crash_write() - write the blocks, unless this is the write that
+ * crashes, which only gets half of them to the disk.
+ */
+static int crash_write(block_device *dev, int start_address, int nblocks, void *buffer)
+{
+  int fd = (int)(long)dev->private_data;
+  int n = nblocks;
+
+  if (writes_left == 0) {
+    n = nblocks / 2;
+  }
+  if (pwrite(fd, buffer, (size_t)n * dev->block_size, (off_t)start_address * dev->block_size) !=
+      (ssize_t)n * dev->block_size) {
+    return -1;
+  }
+  if (writes_left == 0) {
+    _exit(0);
+  }
+  if (writes_left > 0) {
+    writes_left--;
+  }
+  return nblocks;
+}
+
+static int crash_sync(block_device *dev)
+{
+  return 0;
+}
+
+static int crash_close(block_device *dev)
+{
+  return close((int)(long)dev->private_data);
+}
+
+static const block_device_ops crash_ops = {
+  .name = "crash",
+  .open = crash_open,
+  .read = crash_read,
+  .write = crash_write,
+  .sync = crash_sync,
+  .close = crash_close,
+};
+
+/* fill_record() - the contents of the i-th record.
+ */
+void fill_record(char *record, int i)
+{
+  int j;
+
+  for (j = 0; j < RECORD_BYTES; j++) {
+    record[j] = (char)('A' + (i * 7 + j) % 26);
+  }
+}
+
+/* mount() - format or mount the disk, through the crashing device.
+ */
+void mount(int fresh, int durability)
+{
+  sfs_options options;
+
+  sfs_default_options(&options);
+  options.durability = durability;
+  mksfs_with_options(fresh, &options);
+}
+
+/* run_writer() - write the records, acknowledging each one on the pipe
+ * once it is durable, with the crash after crash_at block writes.
+ */
+void run_writer(int durability, int crash_at, int ack_fd)
+{
+  char record[RECORD_BYTES];
+  char name[MAXFILENAME];
+  int fd, i;
+
+  mount(1, durability);
+  fd = sfs_fopen("log.dat");
+  sfs_sync();
+  writes_left = crash_at;
+
+  for (i = 0; i < NUM_RECORDS; i++) {
+    fill_record(record, i);
+    if (sfs_pwrite(fd, record, RECORD_BYTES, i * RECORD_BYTES) != RECORD_BYTES) {
+      break;
+    }
+    if (i % FILE_EVERY == 0) {
+      sprintf(name, "f%d.txt", i);
+      sfs_fclose(sfs_fopen(name));
+    }
+    if (durability == SFS_WRITE_BACK) {
+      sfs_fsync(fd);
+    }
+    if (write(ack_fd, &i, sizeof(i)) != sizeof(i)) {
+      break;
+    }
+  }
+}
+
+/* check_volume() - remount the disk, and check what survived the crash.
+ */
+int check_volume(int durability, int num_of_acked, int crash_at)
+{
+  char record[RECORD_BYTES], got[RECORD_BYTES];
+  char name[MAXFILENAME];
+  int error_count = 0;
+  int fd, i, size, num_of_records;
+
+  writes_left = -1;
+  mount(0, durability);
+
+  size = sfs_getfilesize("log.dat");
+  if (size < num_of_acked * RECORD_BYTES) {
+    fprintf(stderr, "ERROR: Crash at write %d lost acknowledged records, %d bytes for %d records\n", crash_at,
+            size, num_of_acked);
+    error_count++;
+  }
+  if (size % RECORD_BYTES != 0) {
+    fprintf(stderr, "ERROR: Crash at write %d tore a record, the file has %d bytes\n", crash_at, size);
+    error_count++;
+  }
+
+  /* Every record the file holds is whole, acknowledged or not, even once
+   * a new file takes the blocks the volume says are free. */
+  num_of_records = size / RECORD_BYTES;
+  memset(record, 'Z', RECORD_BYTES);
+  fd = sfs_fopen("after.dat");
+  for (i = 0; i < NUM_RECORDS; i++) {
+    sfs_fwrite(fd, record, RECORD_BYTES);
+  }
+  sfs_fclose(fd);
+  fd = sfs_fopen("log.dat");
+  for (i = 0; i < num_of_records; i++) {
+    fill_record(record, i);
+    if (sfs_pread(fd, got, RECORD_BYTES, i * RECORD_BYTES) != RECORD_BYTES ||
+        memcmp(got, record, RECORD_BYTES) != 0) {
+      fprintf(stderr, "ERROR: Crash at write %d corrupted record %d\n", crash_at, i);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+
+  for (i = 0; i < num_of_acked; i += FILE_EVERY) {
+    sprintf(name, "f%d.txt", i);
+    if (sfs_getfilesize(name) != 0) {
+      fprintf(stderr, "ERROR: Crash at write %d lost the acknowledged file %s\n", crash_at, name);
+      error_count++;
+    }
+  }
+
+  /* Nothing is left to reach the disk of the next round at its mount. */
+  sfs_sync();
+  return error_count;
+}
+
+/* run_round() - crash a writer at a block write, and check the volume it
+ * leaves. Sets *done when the writer finished before the crash.
+ */
+int run_round(int durability, int crash_at, int *done)
+{
+  int pipe_fds[2];
+  int num_of_acked = 0;
+  int ack, status;
+  pid_t pid;
+
+  if (pipe(pipe_fds) == -1) {
+    return 1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    run_writer(durability, crash_at, pipe_fds[1]);
+    _exit(1);
+  }
+  close(pipe_fds[1]);
+  while (read(pipe_fds[0], &ack, sizeof(ack)) == sizeof(ack)) {
+    num_of_acked = ack + 1;
+  }
+  close(pipe_fds[0]);
+  waitpid(pid, &status, 0);
+
+  /* The writer exits with 1 only when it got to the end. */
+  *done = WIFEXITED(status) && WEXITSTATUS(status) == 1;
+  return check_volume(durability, num_of_acked, crash_at);
+}
+
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+  int durability, crash_at, done;
+
+  set_disk_backend_ops(&crash_ops);
+  for (durability = SFS_WRITE_THROUGH; durability <= SFS_WRITE_BACK; durability++) {
+    done = 0;
+    for (crash_at = 0; !done; crash_at++) {
+      error_count += run_round(durability, crash_at, &done);
+    }
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
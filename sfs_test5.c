@@ -0,0 +1,384 @@
+/* sfs_test5.c
+ *
+ * Checks that the calls working on whole files leave what they should on
+ * the disk, whether the volume is mounted write-through or write-back:
+ * each test changes files, remounts the volume, and reads them back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define FILE_BYTES 5000 /* Files that span a few blocks */
+#define SMALL_BYTES 200 /* Files that fit in their i-Node */
+#define FRAG_BLOCKS 20  /* Files that need an indirect block */
+#define BATCH_FILES 150 /* A batch that outgrows the journal */
+
+/* mount() - format or mount the volume.
+ */
+void mount(int fresh, int durability)
+{
+  sfs_options options;
+
+  sfs_default_options(&options);
+  options.durability = durability;
+  mksfs_with_options(fresh, &options);
+}
+
+/* remount() - make every call durable, and mount the volume again.
+ */
+void remount(int durability)
+{
+  sfs_sync();
+  mount(0, durability);
+}
+
+/* fill() - fill a buffer with bytes that differ from one seed to another.
+ */
+void fill(char *buffer, int length, int seed)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    buffer[i] = (char)('a' + (i * 3 + seed) % 26);
+  }
+}
+
+/* check_file() - check the size and the contents of a file, and count
+ * the differences as errors.
+ */
+int check_file(char *filename, const char *expected, int length, const char *when)
+{
+  char *buffer = malloc(length + 1);
+  int error_count = 0;
+  int fd, size = sfs_getfilesize(filename);
+
+  if (size != length) {
+    fprintf(stderr, "ERROR: %s has %d bytes %s, not %d\n", filename, size, when, length);
+    free(buffer);
+    return 1;
+  }
+  fd = sfs_fopen(filename);
+  if (sfs_pread(fd, buffer, length, 0) != length || memcmp(buffer, expected, length) != 0) {
+    fprintf(stderr, "ERROR: %s reads back wrong %s\n", filename, when);
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buffer);
+  return error_count;
+}
+
+/* run_truncate_test() - shrink and grow a file, which reads back the
+ * bytes it kept followed by zeros.
+ */
+int run_truncate_test(int durability)
+{
+  char expected[FILE_BYTES], buffer[FILE_BYTES];
+  int error_count = 0;
+  int fd;
+
+  mount(1, durability);
+  fill(expected, FILE_BYTES, 0);
+  fd = sfs_fopen("trunc.txt");
+  sfs_fwrite(fd, expected, FILE_BYTES);
+
+  /* Into the middle of a block, so that a write past the new end leaves
+   * a hole over the bytes cut off, then past the old end of the file. */
+  if (sfs_ftruncate(fd, 1500) != 1) {
+    fprintf(stderr, "ERROR: Shrinking a file did not return 1\n");
+    error_count++;
+  }
+  memset(expected + 1500, 0, FILE_BYTES - 1500);
+  fill(expected + 3000, 100, 2);
+  sfs_pwrite(fd, expected + 3000, 100, 3000);
+  if (sfs_ftruncate(fd, 4000) != 1) {
+    fprintf(stderr, "ERROR: Growing a file did not return 1\n");
+    error_count++;
+  }
+  if (sfs_getfilesize("trunc.txt") != 4000 || sfs_pread(fd, buffer, 4000, 0) != 4000 ||
+      memcmp(buffer, expected, 4000) != 0) {
+    fprintf(stderr, "ERROR: trunc.txt reads back wrong once truncated\n");
+    error_count++;
+  }
+  if (sfs_ftruncate(fd, -1) != -1) {
+    fprintf(stderr, "ERROR: Truncating to a negative size did not fail\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  if (sfs_ftruncate(fd, 0) != -1) {
+    fprintf(stderr, "ERROR: Truncating a closed file did not fail\n");
+    error_count++;
+  }
+
+  remount(durability);
+  error_count += check_file("trunc.txt", expected, 4000, "once truncated and remounted");
+
+  /* Down to nothing, and writing again from there. */
+  fd = sfs_fopen("trunc.txt");
+  if (sfs_ftruncate(fd, 0) != 1) {
+    fprintf(stderr, "ERROR: Truncating to 0 did not return 1\n");
+    error_count++;
+  }
+  fill(expected, FILE_BYTES, 1);
+  sfs_pwrite(fd, expected, FILE_BYTES, 0);
+  sfs_fclose(fd);
+
+  remount(durability);
+  error_count += check_file("trunc.txt", expected, FILE_BYTES, "rewritten after a truncation to 0");
+  return error_count;
+}
+
+/* count_block_reads() - read a file from its start, and count the blocks
+ * the read took from the disk or the cache.
+ */
+int count_block_reads(char *filename, int length)
+{
+  char *buffer = malloc(length);
+  sfs_stats stats;
+  int fd = sfs_fopen(filename);
+
+  sfs_reset_stats();
+  sfs_pread(fd, buffer, length, 0);
+  sfs_get_stats(&stats);
+  sfs_fclose(fd);
+  free(buffer);
+  return (int)(stats.disk_reads + stats.cache_misses + stats.cache_hits);
+}
+
+/* run_inline_test() - write a small file, which is read out of its i-Node,
+ * then grow it into data blocks and shrink it back under the size it had.
+ */
+int run_inline_test(int durability)
+{
+  char expected[FILE_BYTES];
+  int error_count = 0;
+  int fd;
+
+  mount(1, durability);
+  fill(expected, FILE_BYTES, 3);
+  fd = sfs_fopen("small.txt");
+  sfs_fwrite(fd, expected, SMALL_BYTES / 2);
+  sfs_fwrite(fd, expected + SMALL_BYTES / 2, SMALL_BYTES / 2);
+  sfs_fclose(fd);
+
+  remount(durability);
+  error_count += check_file("small.txt", expected, SMALL_BYTES, "inline after a remount");
+  if (count_block_reads("small.txt", SMALL_BYTES) != 0) {
+    fprintf(stderr, "ERROR: Reading a small file read blocks\n");
+    error_count++;
+  }
+
+  /* Growing past the i-Node moves the data into blocks. */
+  fd = sfs_fopen("small.txt");
+  sfs_pwrite(fd, expected + SMALL_BYTES, FILE_BYTES - SMALL_BYTES, SMALL_BYTES);
+  sfs_fclose(fd);
+  error_count += check_file("small.txt", expected, FILE_BYTES, "grown out of its i-Node");
+
+  remount(durability);
+  error_count += check_file("small.txt", expected, FILE_BYTES, "grown out of its i-Node and remounted");
+  if (count_block_reads("small.txt", FILE_BYTES) == 0) {
+    fprintf(stderr, "ERROR: Reading a file grown out of its i-Node read no blocks\n");
+    error_count++;
+  }
+
+  /* Shrinking it back keeps what is left, and so does a small file
+   * shrunk while inline. */
+  fd = sfs_fopen("small.txt");
+  sfs_ftruncate(fd, SMALL_BYTES / 2);
+  sfs_fclose(fd);
+  fd = sfs_fopen("tiny.txt");
+  sfs_fwrite(fd, expected, SMALL_BYTES);
+  sfs_ftruncate(fd, SMALL_BYTES / 4);
+  sfs_fclose(fd);
+
+  remount(durability);
+  error_count += check_file("small.txt", expected, SMALL_BYTES / 2, "shrunk back and remounted");
+  error_count += check_file("tiny.txt", expected, SMALL_BYTES / 4, "shrunk inline and remounted");
+  return error_count;
+}
+
+/* run_delayed_test() - append to files writing back, whose blocks are
+ * chosen when they are closed, synced or truncated, and check that the
+ * files read the same before and after that.
+ */
+int run_delayed_test()
+{
+  char expected[FILE_BYTES], buffer[FILE_BYTES];
+  int error_count = 0;
+  int fd_a, fd_b, i, chunk = FILE_BYTES / 5;
+
+  mount(1, SFS_WRITE_BACK);
+  fill(expected, FILE_BYTES, 4);
+
+  /* Appends interleaved between two files, each of which still gets a
+   * single run of blocks once closed. */
+  fd_a = sfs_fopen("a.dat");
+  fd_b = sfs_fopen("b.dat");
+  for (i = 0; i < FILE_BYTES; i += chunk) {
+    sfs_fwrite(fd_a, expected + i, chunk);
+    sfs_fwrite(fd_b, expected + i, chunk);
+  }
+  if (sfs_pread(fd_a, buffer, FILE_BYTES, 0) != FILE_BYTES || memcmp(buffer, expected, FILE_BYTES) != 0) {
+    fprintf(stderr, "ERROR: Data waiting for its blocks reads back wrong\n");
+    error_count++;
+  }
+  sfs_fclose(fd_a);
+  sfs_fclose(fd_b);
+  error_count += check_file("a.dat", expected, FILE_BYTES, "once closed");
+  if (sfs_defrag_file("a.dat") != 0 || sfs_defrag_file("b.dat") != 0) {
+    fprintf(stderr, "ERROR: Interleaved appends did not get a run of blocks per file\n");
+    error_count++;
+  }
+
+  /* Synced, then truncated before its appends get blocks. */
+  fd_a = sfs_fopen("fsync.dat");
+  sfs_fwrite(fd_a, expected, FILE_BYTES);
+  if (sfs_fsync(fd_a) != 0) {
+    fprintf(stderr, "ERROR: Syncing appended data failed\n");
+    error_count++;
+  }
+  sfs_fclose(fd_a);
+  fd_a = sfs_fopen("trunc.dat");
+  sfs_fwrite(fd_a, expected, FILE_BYTES);
+  sfs_ftruncate(fd_a, FILE_BYTES / 2);
+  sfs_pwrite(fd_a, expected + FILE_BYTES / 2, chunk, FILE_BYTES / 2);
+  sfs_fclose(fd_a);
+
+  remount(SFS_WRITE_BACK);
+  error_count += check_file("a.dat", expected, FILE_BYTES, "once closed and remounted");
+  error_count += check_file("b.dat", expected, FILE_BYTES, "once closed and remounted");
+  error_count += check_file("fsync.dat", expected, FILE_BYTES, "once synced and remounted");
+  error_count += check_file("trunc.dat", expected, FILE_BYTES / 2 + chunk, "once truncated and remounted");
+  return error_count;
+}
+
+/* run_defrag_test() - scatter the blocks of files by appending to them
+ * in turn, then defragment them.
+ */
+int run_defrag_test(int durability)
+{
+  char *expected = malloc(FRAG_BLOCKS * 1024), *buffer = malloc(FRAG_BLOCKS * 1024);
+  int error_count = 0;
+  int fd_a, fd_b, i, moved, length = FRAG_BLOCKS * 1024;
+
+  mount(1, durability);
+  fill(expected, length, 5);
+
+  /* Each append is synced, so that it gets its block there and then. */
+  fd_a = sfs_fopen("frag.dat");
+  fd_b = sfs_fopen("gap.dat");
+  for (i = 0; i < length; i += 1024) {
+    sfs_fwrite(fd_a, expected + i, 1024);
+    sfs_fsync(fd_a);
+    sfs_fwrite(fd_b, expected + i, 1024);
+    sfs_fsync(fd_b);
+  }
+  sfs_fclose(fd_b);
+  sfs_remove("gap.dat");
+
+  /* The file is defragmented while open, and reads on through its FD. */
+  moved = sfs_defrag_file("frag.dat");
+  if (moved != FRAG_BLOCKS) {
+    fprintf(stderr, "ERROR: Defragmenting moved %d blocks, not %d\n", moved, FRAG_BLOCKS);
+    error_count++;
+  }
+  if (sfs_pread(fd_a, buffer, length, 0) != length || memcmp(buffer, expected, length) != 0) {
+    fprintf(stderr, "ERROR: A file reads back wrong through its FD once defragmented\n");
+    error_count++;
+  }
+  sfs_fclose(fd_a);
+  if (sfs_defrag_file("gap.dat") != -1) {
+    fprintf(stderr, "ERROR: Defragmenting a removed file did not fail\n");
+    error_count++;
+  }
+
+  remount(durability);
+  error_count += check_file("frag.dat", expected, length, "once defragmented and remounted");
+  if (sfs_defrag_file("frag.dat") != 0) {
+    fprintf(stderr, "ERROR: A defragmented file was defragmented again after a remount\n");
+    error_count++;
+  }
+  free(expected);
+  free(buffer);
+  return error_count;
+}
+
+/* check_batch_count() - count an error if a batch call got another count.
+ */
+int check_batch_count(int count, int expected, const char *call)
+{
+  if (count != expected) {
+    fprintf(stderr, "ERROR: %s counted %d files, not %d\n", call, count, expected);
+    return 1;
+  }
+  return 0;
+}
+
+/* run_batch_test() - create, look up and remove files in batches that skip
+ * some of their names, and a batch too large for a single transaction.
+ */
+int run_batch_test(int durability)
+{
+  char long_name[] = "a_name_much_longer_than_any_file_name_may_be.txt";
+  char *create_names[] = {"b1.txt", "b2.txt", "b1.txt", long_name, "pre.txt"};
+  char *stat_names[] = {"b1.txt", "pre.txt", "none.txt", "b2.txt"};
+  char *remove_names[] = {"b1.txt", "none.txt", "b2.txt", "b1.txt"};
+  char *names[BATCH_FILES];
+  int sizes[BATCH_FILES];
+  int error_count = 0;
+  int fd, i;
+
+  mount(1, durability);
+  fd = sfs_fopen("pre.txt");
+  sfs_fwrite(fd, "pre", 3);
+  sfs_fclose(fd);
+
+  /* The second b1.txt exists by the time it comes, and so does pre.txt. */
+  error_count += check_batch_count(sfs_create_many(create_names, 5), 2, "sfs_create_many");
+  remount(durability);
+  error_count += check_batch_count(sfs_stat_many(stat_names, 4, sizes), 3, "sfs_stat_many");
+  if (sizes[0] != 0 || sizes[1] != 3 || sizes[2] != -1 || sizes[3] != 0) {
+    fprintf(stderr, "ERROR: sfs_stat_many got the sizes %d %d %d %d\n", sizes[0], sizes[1], sizes[2], sizes[3]);
+    error_count++;
+  }
+
+  error_count += check_batch_count(sfs_remove_many(remove_names, 4), 2, "sfs_remove_many");
+  remount(durability);
+  error_count += check_batch_count(sfs_stat_many(stat_names, 4, sizes), 1, "sfs_stat_many after removing");
+
+  /* A batch of more files than a transaction holds commits on the way. */
+  for (i = 0; i < BATCH_FILES; i++) {
+    names[i] = malloc(MAXFILENAME);
+    sprintf(names[i], "m%d.txt", i);
+  }
+  error_count += check_batch_count(sfs_create_many(names, BATCH_FILES), BATCH_FILES, "A large sfs_create_many");
+  remount(durability);
+  error_count += check_batch_count(sfs_stat_many(names, BATCH_FILES, sizes), BATCH_FILES, "A large sfs_stat_many");
+  error_count += check_batch_count(sfs_remove_many(names, BATCH_FILES), BATCH_FILES, "A large sfs_remove_many");
+  remount(durability);
+  error_count += check_batch_count(sfs_stat_many(names, BATCH_FILES, sizes), 0, "A large sfs_stat_many after removing");
+  for (i = 0; i < BATCH_FILES; i++) {
+    free(names[i]);
+  }
+  return error_count;
+}
+
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+
+  error_count += run_truncate_test(SFS_WRITE_THROUGH);
+  error_count += run_truncate_test(SFS_WRITE_BACK);
+  error_count += run_inline_test(SFS_WRITE_THROUGH);
+  error_count += run_inline_test(SFS_WRITE_BACK);
+  error_count += run_delayed_test();
+  error_count += run_defrag_test(SFS_WRITE_THROUGH);
+  error_count += run_defrag_test(SFS_WRITE_BACK);
+  error_count += run_batch_test(SFS_WRITE_THROUGH);
+  error_count += run_batch_test(SFS_WRITE_BACK);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}